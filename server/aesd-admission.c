@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Per-client admission control
+ *
+ *  - One slot per source address, keyed by the client_ip string every
+ *    engine records at accept time, in a hash table of independently
+ *    locked stripes
+ *  - --max-conns-per-ip caps the connections a slot holds open; a
+ *    connection over the cap is closed right after accept, before it
+ *    costs a thread, a queue cell or a store handle
+ *  - --rate-packets and --rate-bytes are token buckets refilled
+ *    continuously and holding one second worth of tokens. A batch is let
+ *    through while the bucket is positive and may leave it in debt, so a
+ *    packet larger than the bucket still gets in, just not twice in a row.
+ *    A client that sends faster is dropped
+ *  - Buckets outlive connections, otherwise the one-packet-per-connection
+ *    protocol would reset them every request. A slot is freed once it has
+ *    no connection and its buckets are full again
+ *  - Rejections and rate drops are counted in the metrics
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* --- POSIX / system headers --- */
+#include <pthread.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define ADMISSION_STRIPES 64
+
+struct admission_slot {
+    char ip[CLIENT_ADDR_LEN];
+    unsigned active;            /* open connections */
+    double packet_tokens;
+    double byte_tokens;
+    uint64_t refill_ns;
+    struct admission_slot *next;
+};
+
+struct admission_stripe {
+    pthread_mutex_t lock;
+    struct admission_slot *head;
+};
+
+static struct admission_stripe stripes[ADMISSION_STRIPES];
+static int admission_enabled;
+
+/* FNV-1a */
+static struct admission_stripe *admission_stripe_of(const char *ip)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*ip) {
+        hash ^= (unsigned char)*ip++;
+        hash *= 16777619u;
+    }
+    return &stripes[hash % ADMISSION_STRIPES];
+}
+
+/* Add the tokens earned since the last refill, up to one second worth */
+static void admission_refill(struct admission_slot *slot, uint64_t now)
+{
+    double elapsed = (now - slot->refill_ns) / 1e9;
+
+    slot->refill_ns = now;
+    if (server_config.rate_packets) {
+        slot->packet_tokens += elapsed * server_config.rate_packets;
+        if (slot->packet_tokens > server_config.rate_packets)
+            slot->packet_tokens = server_config.rate_packets;
+    }
+    if (server_config.rate_bytes) {
+        slot->byte_tokens += elapsed * server_config.rate_bytes;
+        if (slot->byte_tokens > server_config.rate_bytes)
+            slot->byte_tokens = server_config.rate_bytes;
+    }
+}
+
+static int admission_slot_idle(const struct admission_slot *slot)
+{
+    return slot->active == 0 &&
+           (!server_config.rate_packets || slot->packet_tokens >= server_config.rate_packets) &&
+           (!server_config.rate_bytes || slot->byte_tokens >= server_config.rate_bytes);
+}
+
+void admission_init(void)
+{
+    int i;
+
+    admission_enabled = server_config.max_conns_per_ip || server_config.rate_packets ||
+                        server_config.rate_bytes;
+    for (i = 0; i < ADMISSION_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        stripes[i].head = NULL;
+    }
+}
+
+void admission_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < ADMISSION_STRIPES; i++) {
+        while (stripes[i].head) {
+            struct admission_slot *next = stripes[i].head->next;
+
+            free(stripes[i].head);
+            stripes[i].head = next;
+        }
+        pthread_mutex_destroy(&stripes[i].lock);
+    }
+}
+
+int admission_acquire(const char *client_ip, struct admission_slot **slot_out)
+{
+    struct admission_stripe *stripe;
+    struct admission_slot **link, *slot = NULL;
+    uint64_t now;
+    int rc = 0;
+
+    *slot_out = NULL;
+    if (!admission_enabled)
+        return 0;
+
+    stripe = admission_stripe_of(client_ip);
+    now = metrics_now_ns();
+
+    pthread_mutex_lock(&stripe->lock);
+
+    /* Find the slot, freeing idle ones on the way */
+    link = &stripe->head;
+    while (*link) {
+        struct admission_slot *cur = *link;
+
+        if (strcmp(cur->ip, client_ip) == 0) {
+            slot = cur;
+            link = &cur->next;
+            continue;
+        }
+        admission_refill(cur, now);
+        if (admission_slot_idle(cur)) {
+            *link = cur->next;
+            free(cur);
+        } else {
+            link = &cur->next;
+        }
+    }
+
+    if (!slot) {
+        slot = calloc(1, sizeof(*slot));
+        if (!slot) {
+            /* Fail open: admission control must not refuse service by itself */
+            pthread_mutex_unlock(&stripe->lock);
+            return 0;
+        }
+        snprintf(slot->ip, sizeof(slot->ip), "%s", client_ip);
+        slot->packet_tokens = server_config.rate_packets;
+        slot->byte_tokens = server_config.rate_bytes;
+        slot->refill_ns = now;
+        slot->next = stripe->head;
+        stripe->head = slot;
+    }
+
+    if (server_config.max_conns_per_ip && slot->active >= server_config.max_conns_per_ip) {
+        rc = -1;
+    } else {
+        slot->active++;
+        *slot_out = slot;
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (rc != 0) {
+        syslog(LOG_INFO, "Rejected connection from %s: %u connections open",
+               client_ip, server_config.max_conns_per_ip);
+        metrics_conn_rejected();
+    }
+    return rc;
+}
+
+void admission_release(struct admission_slot *slot)
+{
+    struct admission_stripe *stripe;
+
+    if (!slot)
+        return;
+
+    stripe = admission_stripe_of(slot->ip);
+    pthread_mutex_lock(&stripe->lock);
+    slot->active--;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+int admission_charge(struct admission_slot *slot, unsigned packets, size_t bytes)
+{
+    struct admission_stripe *stripe;
+    int rc = 0;
+
+    if (!slot || (!server_config.rate_packets && !server_config.rate_bytes))
+        return 0;
+
+    stripe = admission_stripe_of(slot->ip);
+    pthread_mutex_lock(&stripe->lock);
+
+    admission_refill(slot, metrics_now_ns());
+    if ((server_config.rate_packets && slot->packet_tokens <= 0) ||
+        (server_config.rate_bytes && slot->byte_tokens <= 0)) {
+        rc = -1;
+    } else {
+        slot->packet_tokens -= packets;
+        slot->byte_tokens -= bytes;
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (rc != 0) {
+        syslog(LOG_INFO, "Dropping %s: over the packet rate limit", slot->ip);
+        metrics_rate_limited();
+    }
+    return rc;
+}
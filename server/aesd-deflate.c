@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Compressed replays
+ *
+ *  - A client that sends "AESDREPLAY:deflate\n" gets its replay as a
+ *    series of gzip members, one per DEFLATE_BLOCK_SIZE bytes of store,
+ *    so the reply decodes with zcat or any zlib inflater in gzip mode
+ *  - Blocks are aligned to store offsets. Once a whole block has been
+ *    committed it never changes, so its compressed form is kept in a
+ *    process-wide cache and every later replay sends it without touching
+ *    zlib. The cache stops growing at DEFLATE_CACHE_MAX bytes
+ *  - The tail block, a delta replay that starts mid-block and the char
+ *    device, whose entries move as the driver drops old ones, are
+ *    compressed for each replay with a stream kept by the replay
+ *  - Compressed replays are always copied: there is no file range to
+ *    hand to sendfile or io_uring
+ *  - A hot restart streams the cache to the successor along with the
+ *    store, so the first replays after an upgrade are not cold
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+/* --- POSIX / system headers --- */
+#include <pthread.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <zlib.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define DEFLATE_BLOCK_SIZE (64 * 1024)
+#define DEFLATE_CACHE_MAX (64 * 1024 * 1024)
+
+/* zlib window bits for a gzip wrapper instead of a zlib one */
+#define DEFLATE_GZIP_WINDOW (15 + 16)
+
+struct deflate_block {
+    unsigned char *data;
+    size_t len;
+};
+
+/* Per-replay state */
+struct replay_deflate {
+    z_stream zs;
+    int cacheable;          /* store offsets are stable */
+    int emitted;            /* at least one member went out */
+    int done;
+    char raw[DEFLATE_BLOCK_SIZE];
+    unsigned char *out;
+    size_t out_cap;
+    const unsigned char *pending;   /* into out or a cached block */
+    size_t pending_len;
+};
+
+/* Indexed by store offset / DEFLATE_BLOCK_SIZE; blocks are freed at cleanup only */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct deflate_block *cache;
+static size_t cache_slots;
+static size_t cache_bytes;
+
+/* -------------------------------------------------------------------------
+ * Block cache
+ * ----------------------------------------------------------------------*/
+
+static int deflate_cache_lookup(size_t index, struct deflate_block *block)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (index < cache_slots && cache[index].data) {
+        *block = cache[index];
+        found = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+/* Keep a copy of a compressed block; losing the race or the space is fine */
+static void deflate_cache_insert(size_t index, const unsigned char *data, size_t len)
+{
+    unsigned char *copy;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_bytes + len > DEFLATE_CACHE_MAX ||
+        (index < cache_slots && cache[index].data))
+        goto out;
+
+    if (index >= cache_slots) {
+        size_t slots = cache_slots ? cache_slots * 2 : 64;
+        struct deflate_block *grown;
+
+        while (slots <= index)
+            slots *= 2;
+        grown = realloc(cache, slots * sizeof(*cache));
+        if (!grown)
+            goto out;
+        memset(grown + cache_slots, 0, (slots - cache_slots) * sizeof(*cache));
+        cache = grown;
+        cache_slots = slots;
+    }
+
+    copy = malloc(len);
+    if (!copy)
+        goto out;
+    memcpy(copy, data, len);
+    cache[index].data = copy;
+    cache[index].len = len;
+    cache_bytes += len;
+out:
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* One record per cached block, then DEFLATE_HANDOFF_END */
+#define DEFLATE_HANDOFF_END UINT64_MAX
+
+struct deflate_handoff_record {
+    uint64_t index;
+    uint32_t len;
+};
+
+int deflate_cache_export(int fd)
+{
+    struct deflate_handoff_record rec;
+    size_t i;
+    int rc = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < cache_slots && rc == 0; i++) {
+        if (!cache[i].data)
+            continue;
+        rec.index = i;
+        rec.len = cache[i].len;
+        rc = handoff_write_all(fd, &rec, sizeof(rec));
+        if (rc == 0)
+            rc = handoff_write_all(fd, cache[i].data, cache[i].len);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (rc != 0)
+        return -1;
+    memset(&rec, 0, sizeof(rec));
+    rec.index = DEFLATE_HANDOFF_END;
+    return handoff_write_all(fd, &rec, sizeof(rec));
+}
+
+/* Blocks the store is too short for are not trusted: the store was not handed over */
+int deflate_cache_import(int fd, off_t store_size)
+{
+    struct deflate_handoff_record rec;
+    unsigned char *data = NULL;
+    size_t count = 0;
+
+    while (handoff_read_all(fd, &rec, sizeof(rec)) == 0) {
+        if (rec.index == DEFLATE_HANDOFF_END) {
+            free(data);
+            syslog(LOG_INFO, "deflate cache: %zu block(s) handed over", count);
+            return 0;
+        }
+        /* A member never gets near twice its input; anything more is garbage */
+        if (rec.len > 2 * DEFLATE_BLOCK_SIZE)
+            break;
+
+        free(data);
+        data = malloc(rec.len ? rec.len : 1);
+        if (!data || handoff_read_all(fd, data, rec.len) != 0)
+            break;
+        if ((rec.index + 1) * DEFLATE_BLOCK_SIZE <= (uint64_t)store_size) {
+            deflate_cache_insert(rec.index, data, rec.len);
+            count++;
+        }
+    }
+
+    free(data);
+    syslog(LOG_WARNING, "deflate cache handoff cut short after %zu block(s)", count);
+    return -1;
+}
+
+void deflate_cache_cleanup(void)
+{
+    size_t i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < cache_slots; i++)
+        free(cache[i].data);
+    free(cache);
+    cache = NULL;
+    cache_slots = 0;
+    cache_bytes = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* -------------------------------------------------------------------------
+ * Replays
+ * ----------------------------------------------------------------------*/
+
+static struct replay_deflate *deflate_state_new(int cacheable)
+{
+    struct replay_deflate *z = calloc(1, sizeof(*z));
+
+    if (!z)
+        return NULL;
+
+    if (deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, DEFLATE_GZIP_WINDOW,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    z->out_cap = deflateBound(&z->zs, DEFLATE_BLOCK_SIZE);
+    z->out = malloc(z->out_cap);
+    if (!z->out) {
+        deflateEnd(&z->zs);
+        free(z);
+        return NULL;
+    }
+    z->cacheable = cacheable;
+    return z;
+}
+
+/* Compress raw[0..len) into one complete gzip member in z->out */
+static int deflate_member(struct replay_deflate *z, size_t len)
+{
+    if (deflateReset(&z->zs) != Z_OK)
+        goto fail;
+
+    z->zs.next_in = (unsigned char *)z->raw;
+    z->zs.avail_in = len;
+    z->zs.next_out = z->out;
+    z->zs.avail_out = z->out_cap;
+    /* out_cap is deflateBound(), so one call always finishes */
+    if (deflate(&z->zs, Z_FINISH) != Z_STREAM_END)
+        goto fail;
+
+    z->pending = z->out;
+    z->pending_len = z->out_cap - z->zs.avail_out;
+    z->emitted = 1;
+    metrics_deflate_block(len, z->pending_len, 0);
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "deflate: %s", z->zs.msg ? z->zs.msg : "stream error");
+    errno = EIO;
+    return -1;
+}
+
+/* Queue the next member: from the cache when possible, else compressed here */
+static int deflate_next_block(struct store_handle *handle, struct store_replay *replay,
+                              struct replay_deflate *z, store_read_fn raw_read)
+{
+    off_t start = replay->pos;
+    int aligned = z->cacheable && start % DEFLATE_BLOCK_SIZE == 0;
+    struct deflate_block block;
+    size_t len = 0;
+
+    if (aligned && replay->end - start >= DEFLATE_BLOCK_SIZE &&
+        deflate_cache_lookup(start / DEFLATE_BLOCK_SIZE, &block)) {
+        replay->pos += DEFLATE_BLOCK_SIZE;
+        z->pending = block.data;
+        z->pending_len = block.len;
+        z->emitted = 1;
+        metrics_deflate_block(DEFLATE_BLOCK_SIZE, block.len, 1);
+        return 0;
+    }
+
+    /* The char device may hand out less than asked before its end */
+    while (len < DEFLATE_BLOCK_SIZE) {
+        ssize_t n = raw_read(handle, replay, z->raw + len, DEFLATE_BLOCK_SIZE - len);
+
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        len += n;
+    }
+
+    if (len == 0) {
+        z->done = 1;
+        /* An empty replay is still one valid, empty gzip member */
+        if (z->emitted)
+            return 0;
+    }
+
+    if (deflate_member(z, len) != 0)
+        return -1;
+    if (aligned && len == DEFLATE_BLOCK_SIZE)
+        deflate_cache_insert(start / DEFLATE_BLOCK_SIZE, z->pending, z->pending_len);
+    return 0;
+}
+
+ssize_t deflate_replay_read(struct store_handle *handle, struct store_replay *replay,
+                            char *buf, size_t size, int cacheable, store_read_fn raw_read)
+{
+    struct replay_deflate *z = replay->deflate;
+
+    if (!z) {
+        z = deflate_state_new(cacheable);
+        if (!z)
+            return -1;
+        replay->deflate = z;
+    }
+
+    while (z->pending_len == 0) {
+        if (z->done)
+            return 0;
+        if (deflate_next_block(handle, replay, z, raw_read) != 0)
+            return -1;
+    }
+
+    if (size > z->pending_len)
+        size = z->pending_len;
+    memcpy(buf, z->pending, size);
+    z->pending += size;
+    z->pending_len -= size;
+    return size;
+}
+
+void deflate_replay_end(struct store_replay *replay)
+{
+    struct replay_deflate *z = replay->deflate;
+
+    if (!z)
+        return;
+    deflateEnd(&z->zs);
+    free(z->out);
+    free(z);
+    replay->deflate = NULL;
+}
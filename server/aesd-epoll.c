@@ -0,0 +1,618 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Epoll execution engine for aesdsocket
+ *
+ *  - Non-blocking, edge-triggered client and listening sockets
+ *  - Accept, receive, packet assembly and replay driven from the loop
+ *  - One loop by default, or several loops sharing the listeners through
+ *    EPOLLEXCLUSIVE (one per core with --loops=0); with --reuseport each
+ *    loop accepts TCP clients from its own listener shard instead
+ *  - Every listener (TCP, AF_UNIX) is in every loop's epoll set
+ *  - A replay that makes no progress for --send-timeout is dropped by a
+ *    sweep that runs at least once a second; the same sweep closes
+ *    keep-alive connections idle for --idle-timeout
+ *  - Keep-alive connections go back to receiving after each reply,
+ *    starting with any request already pipelined behind it
+ *  - Signals stay with the main thread, which only waits for shutdown
+ *  - After a hot restart each loop stops accepting and keeps serving its
+ *    connections for up to HANDOFF_DRAIN_MS
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_SWEEP_MAX_MS 1000
+
+/* Per-connection state, owned by exactly one loop */
+struct epoll_conn {
+    int client_fd;
+    char client_ip[CLIENT_ADDR_LEN];
+    uint64_t request_ns;        /* latency clock, 0 between keep-alive requests */
+    struct admission_slot *admission;
+    struct store_handle store;
+    struct store_replay replay;
+    int replaying;              /* packet stored, sending store contents */
+    int copy_replay;            /* zero-copy unavailable, go through tx_buf */
+    uint64_t progress_ns;       /* last time the client accepted replay bytes */
+    int keepalive;              /* a keep-alive reply was sent */
+    uint64_t active_ns;         /* last request byte or keep-alive reply */
+
+    struct packet_framer framer;
+
+    char *tx_buf;               /* replay data not yet accepted by send */
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_cap;
+
+    struct epoll_conn *prev;
+    struct epoll_conn *next;
+};
+
+struct epoll_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int shard;                  /* listener shard, see aesd-shard.c */
+    int listen_fds[MAX_LISTENERS];
+    struct epoll_conn *conn_list_head;
+    struct obj_slab conn_slab;
+    uint64_t swept_ns;          /* last slow and idle client sweep */
+    uint64_t drain_deadline_ns; /* hot restart drain, 0 = not draining */
+};
+
+/* epoll_event.data.ptr values that are not connections */
+static int listener_markers[MAX_LISTENERS];
+static int shutdown_marker;
+
+/* Level-triggered in every loop: a single write wakes them all */
+static int shutdown_event_fd = -1;
+
+/* -------------------------------------------------------------------------
+ * Connection helpers
+ * ----------------------------------------------------------------------*/
+
+static void epoll_conn_close(struct epoll_loop *loop, struct epoll_conn *conn)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+    close(conn->client_fd);
+    if (conn->replaying) {
+        store_replay_end(&conn->replay);
+        metrics_replay_done(conn->replay.pos - conn->replay.start);
+    }
+    store_close(&conn->store);
+    admission_release(conn->admission);
+    metrics_conn_closed(conn->request_ns);
+
+    syslog(LOG_INFO, "Closed connection from %s", conn->client_ip);
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conn_list_head = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    framer_free(&conn->framer);
+    free(conn->tx_buf);
+    slab_free(&loop->conn_slab, conn);
+}
+
+/* Accept until the backlog is drained (edge-triggered listener) */
+static void epoll_accept_clients(struct epoll_loop *loop, int listen_fd)
+{
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        struct epoll_event ev;
+        struct epoll_conn *conn;
+
+        int new_fd = accept4(listen_fd, (struct sockaddr*)&client_addr,
+                             &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                syslog(LOG_ERR, "accept: %s", strerror(errno));
+            return;
+        }
+
+        shard_count_accept(loop->shard);
+
+        conn = slab_alloc(&loop->conn_slab);
+        if (!conn) {
+            close(new_fd);
+            continue;
+        }
+        client_addr_format(new_fd, &client_addr, conn->client_ip, sizeof(conn->client_ip));
+        if (admission_acquire(conn->client_ip, &conn->admission) != 0) {
+            slab_free(&loop->conn_slab, conn);
+            close(new_fd);
+            continue;
+        }
+        conn->framer.admission = conn->admission;
+        conn->client_fd = new_fd;
+        conn->request_ns = metrics_now_ns();
+        metrics_conn_accepted();
+        syslog(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+
+        conn->next = loop->conn_list_head;
+        if (conn->next)
+            conn->next->prev = conn;
+        loop->conn_list_head = conn;
+
+        if (store_open(&conn->store) != 0) {
+            epoll_conn_close(loop, conn);
+            continue;
+        }
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) != 0) {
+            syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+            epoll_conn_close(loop, conn);
+        }
+    }
+}
+
+/*
+ * Receive and store packets until EAGAIN or until no partial packet is
+ * left; on a keep-alive connection, until one packet is complete.
+ * Returns 1 when the received packets are complete, 0 when more data
+ * is needed and -1 when the connection should be closed.
+ */
+static int epoll_conn_receive(struct epoll_conn *conn)
+{
+    while (1) {
+        size_t room;
+        char *buf = framer_reserve(&conn->framer, &room);
+        ssize_t n;
+
+        if (!buf)
+            return -1;
+
+        n = recv(conn->client_fd, buf, room, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+        conn->active_ns = metrics_now_ns();
+        if (!conn->request_ns)
+            conn->request_ns = conn->active_ns;
+
+        framer_commit(&conn->framer, n);
+        n = framer_process(&conn->framer, &conn->store);
+        if (n < 0)
+            return -1;
+        if (framer_request_done(&conn->framer, &conn->store, n))
+            return 1;
+    }
+}
+
+/* Make room for at least BUFFER_SIZE more bytes, within the output queue limit */
+static int epoll_conn_reserve_tx(struct epoll_conn *conn)
+{
+    if (conn->tx_cap - conn->tx_len < BUFFER_SIZE) {
+        size_t new_cap = conn->tx_cap ? conn->tx_cap * 2 : BUFFER_SIZE;
+        char *new_buf;
+
+        if (new_cap > server_config.output_queue_max) {
+            syslog(LOG_WARNING, "Dropping %s: replay exceeds the %zu byte output queue",
+                   conn->client_ip, server_config.output_queue_max);
+            return -1;
+        }
+        new_buf = realloc(conn->tx_buf, new_cap);
+        if (!new_buf)
+            return -1;
+        conn->tx_buf = new_buf;
+        conn->tx_cap = new_cap;
+    }
+    return 0;
+}
+
+/* Keep-alive replies start with their length, ahead of what tx_buf holds */
+static int epoll_conn_reply_header(struct epoll_conn *conn, off_t len)
+{
+    char header[REPLY_HEADER_MAX];
+    size_t n = store_reply_header(&conn->store, header, sizeof(header), len);
+
+    if (epoll_conn_reserve_tx(conn) != 0)
+        return -1;
+    memmove(conn->tx_buf + n, conn->tx_buf, conn->tx_len);
+    memcpy(conn->tx_buf, header, n);
+    conn->tx_len += n;
+    return 0;
+}
+
+/*
+ * Start the replay. A replay that holds the store lock is drained into
+ * tx_buf right away, since the loop cannot keep appends waiting on a
+ * slow socket.
+ */
+static int epoll_conn_replay_begin(struct epoll_conn *conn)
+{
+    int rc = 0;
+    int locked;
+
+    conn->replaying = 1;
+    conn->progress_ns = metrics_now_ns();
+    if (!conn->request_ns)
+        conn->request_ns = conn->progress_ns;
+    store_replay_begin(&conn->store, &conn->replay);
+    locked = conn->replay.locked;
+
+    while (conn->replay.locked) {
+        ssize_t n;
+
+        if (epoll_conn_reserve_tx(conn) != 0) {
+            rc = -1;
+            break;
+        }
+        n = store_replay_read(&conn->store, &conn->replay, conn->tx_buf + conn->tx_len,
+                              conn->tx_cap - conn->tx_len);
+        if (n <= 0) {
+            rc = (n == 0) ? 0 : -1;
+            break;
+        }
+        conn->tx_len += n;
+    }
+
+    if (conn->replay.locked) {
+        /* tx_buf now holds the whole snapshot */
+        conn->replay.end = conn->replay.pos;
+        store_replay_end(&conn->replay);
+    }
+
+    if (rc == 0 && conn->store.keepalive)
+        rc = epoll_conn_reply_header(conn, locked ? (off_t)conn->tx_len
+                                                  : store_replay_remaining(&conn->replay));
+    return rc;
+}
+
+/* Keep-alive: the reply is out, the connection waits for its next request */
+static void epoll_conn_reply_done(struct epoll_conn *conn)
+{
+    store_replay_end(&conn->replay);
+    metrics_replay_done(conn->replay.pos - conn->replay.start);
+    conn->replaying = 0;
+
+    metrics_request_done(conn->request_ns);
+    conn->request_ns = 0;
+    conn->active_ns = metrics_now_ns();
+    if (!conn->keepalive) {
+        conn->keepalive = 1;
+        client_keepalive_socket(conn->client_fd);
+    }
+}
+
+/*
+ * Send the replay snapshot; the socket stays non-blocking and partial
+ * sends resume from tx_off on the next EPOLLOUT.
+ * Returns 1 once everything was sent, 0 when the socket is full and
+ * -1 on error.
+ */
+static int epoll_conn_replay(struct epoll_conn *conn)
+{
+    int progressed = 0;
+
+    while (1) {
+        ssize_t n;
+
+        if (conn->tx_off == conn->tx_len) {
+            conn->tx_off = conn->tx_len = 0;
+
+            if (!conn->copy_replay) {
+                n = store_replay_send(&conn->store, &conn->replay, conn->client_fd);
+                if (n > 0) {
+                    progressed = 1;
+                    continue;
+                }
+                if (n == 0)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    goto full;
+                if (errno != EOPNOTSUPP)
+                    return -1;
+                conn->copy_replay = 1;
+            }
+
+            if (epoll_conn_reserve_tx(conn) != 0)
+                return -1;
+            n = store_replay_read(&conn->store, &conn->replay, conn->tx_buf, conn->tx_cap);
+            if (n <= 0)
+                return (n == 0) ? 1 : -1;
+            conn->tx_len = n;
+        }
+
+        n = send(conn->client_fd, conn->tx_buf + conn->tx_off,
+                 conn->tx_len - conn->tx_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                goto full;
+            return -1;
+        }
+        conn->tx_off += n;
+        progressed = 1;
+    }
+
+full:
+    if (progressed)
+        conn->progress_ns = metrics_now_ns();
+    return 0;
+}
+
+/*
+ * Drop clients whose replay made no progress for send_timeout_ms and
+ * keep-alive clients that sent nothing for idle_timeout_ms
+ */
+static void epoll_sweep(struct epoll_loop *loop)
+{
+    uint64_t now = metrics_now_ns();
+    uint64_t timeout_ns = (uint64_t)server_config.send_timeout_ms * 1000000u;
+    uint64_t idle_ns = (uint64_t)server_config.idle_timeout_ms * 1000000u;
+    struct epoll_conn *conn = loop->conn_list_head;
+
+    loop->swept_ns = now;
+    while (conn) {
+        struct epoll_conn *next = conn->next;
+
+        if (conn->replaying) {
+            if (timeout_ns && now - conn->progress_ns > timeout_ns) {
+                client_evict_slow(conn->client_ip);
+                epoll_conn_close(loop, conn);
+            }
+        } else if (conn->keepalive && idle_ns && now - conn->active_ns > idle_ns) {
+            client_close_idle(conn->client_ip);
+            epoll_conn_close(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+static void epoll_conn_handle(struct epoll_loop *loop, struct epoll_conn *conn,
+                              uint32_t events)
+{
+    int rc;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        epoll_conn_close(loop, conn);
+        return;
+    }
+
+    while (1) {
+        if (!conn->replaying) {
+            rc = epoll_conn_receive(conn);
+            if (rc == 0)
+                return;
+            if (rc == 1)
+                rc = epoll_conn_replay_begin(conn);
+            if (rc < 0) {
+                epoll_conn_close(loop, conn);
+                return;
+            }
+        }
+
+        /* One request per connection unless keep-alive, as in thread mode */
+        rc = epoll_conn_replay(conn);
+        if (rc == 0)
+            return;
+        if (rc == 1 && conn->store.subscribe)
+            pubsub_subscribe(conn->client_fd, conn->client_ip, &conn->store);
+        if (rc < 0 || !conn->store.keepalive || conn->store.subscribe) {
+            epoll_conn_close(loop, conn);
+            return;
+        }
+
+        epoll_conn_reply_done(conn);
+        rc = framer_next_request(&conn->framer, &conn->store);
+        if (rc > 0)
+            rc = epoll_conn_replay_begin(conn);
+        if (rc < 0) {
+            epoll_conn_close(loop, conn);
+            return;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Loop threads
+ * ----------------------------------------------------------------------*/
+
+/* Hot restart: the successor accepts from now on, finish what is open */
+static void epoll_loop_drain(struct epoll_loop *loop)
+{
+    int i;
+
+    for (i = 0; i < listeners_count(); i++)
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fds[i], NULL);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, shutdown_event_fd, NULL);
+    loop->drain_deadline_ns = metrics_now_ns() + (uint64_t)HANDOFF_DRAIN_MS * 1000000u;
+}
+
+static void* epoll_loop_main(void* arg)
+{
+    struct epoll_loop *loop = arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int sweep_ms = server_config.send_timeout_ms;
+    int running = 1;
+
+    shard_pin_thread(loop->shard);
+
+    /* Stalled replays and idle clients are found by a sweep at least once a second */
+    if (!sweep_ms || (server_config.idle_timeout_ms && server_config.idle_timeout_ms < sweep_ms))
+        sweep_ms = server_config.idle_timeout_ms;
+    if (sweep_ms > EPOLL_SWEEP_MAX_MS)
+        sweep_ms = EPOLL_SWEEP_MAX_MS;
+    loop->swept_ns = metrics_now_ns();
+
+    while (running) {
+        int i;
+        int timeout = loop->drain_deadline_ns ? EPOLL_SWEEP_MAX_MS : sweep_ms ? sweep_ms : -1;
+        int n = epoll_wait(loop->epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &shutdown_marker && handoff_draining())
+                epoll_loop_drain(loop);
+            else if (ptr == &shutdown_marker)
+                running = 0;
+            else if ((int *)ptr >= listener_markers &&
+                     (int *)ptr < listener_markers + MAX_LISTENERS)
+                epoll_accept_clients(loop, loop->listen_fds[(int *)ptr - listener_markers]);
+            else
+                epoll_conn_handle(loop, ptr, events[i].events);
+        }
+
+        if (sweep_ms && metrics_now_ns() - loop->swept_ns >= (uint64_t)sweep_ms * 1000000u)
+            epoll_sweep(loop);
+
+        if (loop->drain_deadline_ns &&
+            (!loop->conn_list_head || metrics_now_ns() >= loop->drain_deadline_ns))
+            running = 0;
+    }
+
+    while (loop->conn_list_head)
+        epoll_conn_close(loop, loop->conn_list_head);
+    slab_destroy(&loop->conn_slab);
+
+    return NULL;
+}
+
+static int epoll_loop_init(struct epoll_loop *loop, int shard, int loops)
+{
+    struct epoll_event ev;
+    int i;
+
+    loop->conn_list_head = NULL;
+    loop->drain_deadline_ns = 0;
+    slab_init(&loop->conn_slab, sizeof(struct epoll_conn), 64);
+    loop->shard = shard;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+        return -1;
+
+    for (i = 0; i < listeners_count(); i++) {
+        int fd = listeners_fd(i);
+        int shared = loops > 1;
+
+        /* The TCP listener may be this loop's own shard */
+        if (fd == server_socket_fd) {
+            fd = shard_listen_fd(shard);
+            shared = shared && !server_config.reuseport;
+        }
+        loop->listen_fds[i] = fd;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        ev.events = EPOLLIN | EPOLLET | (shared ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = &listener_markers[i];
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            goto fail;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &shutdown_marker;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, shutdown_event_fd, &ev) != 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    close(loop->epoll_fd);
+    return -1;
+}
+
+int epoll_server_run(void)
+{
+    struct epoll_loop *loops;
+    sigset_t all_signals, old_mask;
+    int num_loops = server_config.num_loops;
+    int started = 0;
+    int i;
+
+    if (num_loops <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_loops = cpus > 0 ? (int)cpus : 1;
+    }
+
+    shutdown_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    loops = calloc(num_loops, sizeof(struct epoll_loop));
+    if (shutdown_event_fd < 0 || !loops || shards_init(num_loops) != 0) {
+        syslog(LOG_ERR, "epoll engine: %s", strerror(errno));
+        free(loops);
+        if (shutdown_event_fd != -1)
+            close(shutdown_event_fd);
+        return -1;
+    }
+
+    /* Loop threads inherit a fully blocked mask: signals go to main */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+
+    for (i = 0; i < num_loops; i++) {
+        if (epoll_loop_init(&loops[i], i, num_loops) != 0)
+            break;
+        if (pthread_create(&loops[i].thread, NULL, epoll_loop_main, &loops[i]) != 0) {
+            close(loops[i].epoll_fd);
+            break;
+        }
+        started++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (started == num_loops) {
+        syslog(LOG_INFO, "epoll engine running %d loop(s)", num_loops);
+        wait_for_exit_signal(shards_log_stats);
+    } else {
+        syslog(LOG_ERR, "epoll engine: started %d of %d loops", started, num_loops);
+    }
+
+    eventfd_write(shutdown_event_fd, 1);
+    for (i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].epoll_fd);
+    }
+
+    shards_log_stats();
+    shards_cleanup();
+    close(shutdown_event_fd);
+    shutdown_event_fd = -1;
+    free(loops);
+
+    return started == num_loops ? 0 : -1;
+}
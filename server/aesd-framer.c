@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Incremental packet framer
+ *
+ *  - Received bytes accumulate in one growable buffer per connection,
+ *    taken from the receive buffer cache (aesd-slab.c) and returned to
+ *    it on close; packets of any size up to --max-packet are assembled
+ *    in place and stored with one write
+ *  - Newlines are found with memchr, and bytes already scanned are not
+ *    scanned again when a packet arrives in several segments
+ *  - AESDCHAR_IOCSEEKTO and AESDREPLAY are only recognized at the start
+ *    of a packet, and are never stored
+ *  - Consecutive data packets go to the store in one writev, one iovec
+ *    per packet so the char device still records one entry per packet
+ *  - On a keep-alive connection each packet is a request of its own:
+ *    packets are handled one at a time, pipelined ones stay buffered
+ *    until the reply before them is sent
+ *  - A connection that opens with BINARY_PREAMBLE speaks length-prefixed
+ *    records instead: payloads are never scanned, quiet APPENDs batch
+ *    into one writev like text packets, and the connection is keep-alive
+ *    with one reply per remaining record. The store stays a log of
+ *    packets: binary payloads holding newlines keep their own write
+ *    command until a restart rebuilds the index from newlines
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+
+/* --- POSIX / system headers --- */
+#include <endian.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+/* --- Project headers --- */
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
+
+/* Data packets batched into one store_appendv() call */
+#define FRAMER_MAX_IOV 64
+
+#define SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define REPLAY_PREFIX "AESDREPLAY:"
+
+void framer_init(struct packet_framer *framer)
+{
+    memset(framer, 0, sizeof(*framer));
+}
+
+void framer_free(struct packet_framer *framer)
+{
+    rxbuf_put(framer->buf, framer->cap);
+    framer_init(framer);
+}
+
+char *framer_reserve(struct packet_framer *framer, size_t *room)
+{
+    if (!framer->buf) {
+        framer->buf = rxbuf_get(&framer->cap);
+        if (!framer->buf)
+            return NULL;
+    }
+
+    if (framer->cap - framer->len < BUFFER_SIZE) {
+        size_t new_cap = framer->cap ? framer->cap * 2 : BUFFER_SIZE;
+        char *new_buf = realloc(framer->buf, new_cap);
+        if (!new_buf)
+            return NULL;
+        framer->buf = new_buf;
+        framer->cap = new_cap;
+    }
+
+    *room = framer->cap - framer->len;
+    return framer->buf + framer->len;
+}
+
+void framer_commit(struct packet_framer *framer, size_t len)
+{
+    framer->len += len;
+    metrics_bytes_in(len);
+}
+
+/* Parse "AESDCHAR_IOCSEEKTO:x,y\n" within one packet */
+static int packet_is_seekto(const char *packet, size_t len, struct aesd_seekto *seek)
+{
+    char cmd[64];
+    size_t prefix_len = sizeof(SEEKTO_PREFIX) - 1;
+
+    if (len <= prefix_len || len >= sizeof(cmd) ||
+        memcmp(packet, SEEKTO_PREFIX, prefix_len) != 0)
+        return 0;
+
+    memcpy(cmd, packet + prefix_len, len - prefix_len);
+    cmd[len - prefix_len] = '\0';
+
+    return sscanf(cmd, "%u,%u", &seek->write_cmd, &seek->write_cmd_offset) == 2;
+}
+
+/*
+ * "AESDREPLAY:from=<byte offset>\n", "AESDREPLAY:since=<write cmd>\n" or
+ * "AESDREPLAY:new\n"; "AESDREPLAY:deflate\n" asks for compression and
+ * "AESDREPLAY:subscribe\n" for the packets appended after the replay,
+ * "AESDREPLAY:keepalive\n" for one framed reply per packet on a
+ * connection that stays open; all of them combine with the others.
+ * Returns 0 if the packet is not a replay request.
+ */
+static int packet_is_replay_request(const char *packet, size_t len,
+                                    struct store_handle *handle)
+{
+    char cmd[64];
+    size_t prefix_len = sizeof(REPLAY_PREFIX) - 1;
+    unsigned long long value;
+    char tail;
+
+    if (len <= prefix_len || len >= sizeof(cmd) ||
+        memcmp(packet, REPLAY_PREFIX, prefix_len) != 0)
+        return 0;
+
+    memcpy(cmd, packet + prefix_len, len - prefix_len);
+    cmd[len - prefix_len] = '\0';
+
+    if (strcmp(cmd, "new\n") == 0)
+        store_replay_new(handle);
+    else if (strcmp(cmd, "deflate\n") == 0)
+        store_replay_deflate(handle);
+    else if (strcmp(cmd, "subscribe\n") == 0)
+        store_replay_subscribe(handle);
+    else if (strcmp(cmd, "keepalive\n") == 0)
+        store_replay_keepalive(handle);
+    else if (sscanf(cmd, "from=%llu%c", &value, &tail) == 2 && tail == '\n')
+        store_replay_from(handle, (off_t)value);
+    else if (sscanf(cmd, "since=%llu%c", &value, &tail) == 2 && tail == '\n' &&
+             value <= UINT_MAX)
+        store_replay_since(handle, (unsigned int)value);
+    else
+        return 0;
+    return 1;
+}
+
+/* Append the batch, if the client's rate limits let it through */
+static int framer_flush(struct packet_framer *framer, struct iovec *iov, int *iovcnt)
+{
+    size_t bytes = 0;
+    int rc = 0;
+    int i;
+
+    if (*iovcnt > 0 && server_config.replica_of) {
+        /* Replicas only hold what the primary sends them */
+        syslog(LOG_WARNING, "data packet sent to a read-only replica, refused");
+        errno = EROFS;
+        rc = -1;
+    } else if (*iovcnt > 0) {
+        for (i = 0; i < *iovcnt; i++)
+            bytes += iov[i].iov_len;
+        rc = admission_charge(framer->admission, *iovcnt, bytes);
+        if (rc == 0) {
+            rc = store_appendv(iov, *iovcnt);
+        } else {
+            framer->rate_limited = 1;
+            errno = EAGAIN;
+        }
+    }
+    *iovcnt = 0;
+    return rc;
+}
+
+/* ---- Binary records ---- */
+
+/*
+ * Decide the protocol from the first bytes: 1 once decided, 0 while they
+ * could still be the start of BINARY_PREAMBLE
+ */
+static int framer_negotiate(struct packet_framer *framer, struct store_handle *handle)
+{
+    size_t n = framer->len < BINARY_PREAMBLE_LEN ? framer->len : BINARY_PREAMBLE_LEN;
+
+    if (memcmp(framer->buf, BINARY_PREAMBLE, n) != 0) {
+        framer->negotiated = 1;
+        return 1;
+    }
+    if (n < BINARY_PREAMBLE_LEN)
+        return 0;
+
+    memmove(framer->buf, framer->buf + n, framer->len - n);
+    framer->len -= n;
+    framer->negotiated = 1;
+    handle->binary = 1;
+    store_replay_keepalive(handle);
+    return 1;
+}
+
+/* The errno for a reply; a quiet APPEND that failed before takes precedence */
+static int framer_status(struct packet_framer *framer, int rc)
+{
+    int status = framer->quiet_errno ? framer->quiet_errno : (rc != 0 ? errno : 0);
+
+    framer->quiet_errno = 0;
+    return status;
+}
+
+/* Handle one record other than APPEND; its reply is set on handle */
+static void framer_binary_request(struct packet_framer *framer, struct store_handle *handle,
+                                  const struct binary_header *header, const char *payload)
+{
+    size_t len = be32toh(header->length);
+    uint64_t offset;
+    uint32_t seek[2];
+    char *report;
+    int rc = 0;
+
+    switch (header->opcode) {
+    case BINARY_OP_REPLAY:
+        if (len == sizeof(offset)) {
+            memcpy(&offset, payload, sizeof(offset));
+            offset = be64toh(offset);
+            if (offset > INT64_MAX) {
+                errno = EINVAL;
+                rc = -1;
+            } else {
+                rc = store_replay_from(handle, (off_t)offset);
+            }
+        } else if (len != 0) {
+            errno = EINVAL;
+            rc = -1;
+        } else {
+            /* A full replay, whatever an earlier record seeked to */
+            store_replay_all(handle);
+        }
+        store_reply_binary(handle, BINARY_OP_REPLAY, framer_status(framer, rc), NULL, 0);
+        break;
+    case BINARY_OP_SEEKTO:
+        if (len == sizeof(seek)) {
+            memcpy(seek, payload, sizeof(seek));
+            rc = store_seekto(handle, be32toh(seek[0]), be32toh(seek[1]));
+        } else {
+            errno = EINVAL;
+            rc = -1;
+        }
+        store_reply_binary(handle, BINARY_OP_SEEKTO, framer_status(framer, rc), NULL, 0);
+        break;
+    case BINARY_OP_STATS:
+        report = malloc(METRICS_REPORT_SIZE);
+        if (!report) {
+            store_reply_binary(handle, BINARY_OP_STATS, framer_status(framer, -1), NULL, 0);
+            break;
+        }
+        store_reply_binary(handle, BINARY_OP_STATS, framer_status(framer, 0), report,
+                           metrics_format(report, METRICS_REPORT_SIZE));
+        break;
+    default:
+        errno = EINVAL;
+        store_reply_binary(handle, header->opcode, framer_status(framer, -1), NULL, 0);
+    }
+}
+
+/*
+ * Handle complete records up to and including the first one that needs a
+ * reply. Quiet APPENDs before it are batched, the others are appended
+ * when their reply is due.
+ */
+static int framer_process_binary(struct packet_framer *framer, struct store_handle *handle)
+{
+    struct iovec iov[FRAMER_MAX_IOV];
+    struct binary_header header;
+    int iovcnt = 0;
+    int records = 0;
+    int rc = 0;
+    size_t start = 0;
+
+    framer->reply_due = 0;
+    while (!framer->reply_due && framer->len - start >= sizeof(header)) {
+        const char *payload = framer->buf + start + sizeof(header);
+        size_t len;
+
+        memcpy(&header, framer->buf + start, sizeof(header));
+        len = be32toh(header.length);
+        if (server_config.max_packet_size && len > server_config.max_packet_size) {
+            syslog(LOG_WARNING, "record longer than %zu bytes, dropping the connection",
+                   server_config.max_packet_size);
+            errno = EMSGSIZE;
+            rc = -1;
+            break;
+        }
+        if (framer->len - start - sizeof(header) < len)
+            break;
+
+        if (header.opcode == BINARY_OP_APPEND) {
+            iov[iovcnt].iov_base = (char *)payload;
+            iov[iovcnt].iov_len = len;
+            if (++iovcnt == FRAMER_MAX_IOV || !(header.flags & BINARY_FLAG_QUIET)) {
+                int flushed = framer_flush(framer, iov, &iovcnt);
+
+                if (header.flags & BINARY_FLAG_QUIET) {
+                    if (flushed != 0 && !framer->quiet_errno)
+                        framer->quiet_errno = errno;
+                } else {
+                    store_reply_binary(handle, BINARY_OP_APPEND,
+                                       framer_status(framer, flushed), NULL, 0);
+                    framer->reply_due = 1;
+                }
+            }
+        } else {
+            if (framer_flush(framer, iov, &iovcnt) != 0 && !framer->quiet_errno)
+                framer->quiet_errno = errno;
+            framer_binary_request(framer, handle, &header, payload);
+            framer->reply_due = 1;
+        }
+
+        records++;
+        start += sizeof(header) + len;
+    }
+
+    if (framer_flush(framer, iov, &iovcnt) != 0 && !framer->quiet_errno)
+        framer->quiet_errno = errno;
+
+    if (start > 0) {
+        memmove(framer->buf, framer->buf + start, framer->len - start);
+        framer->len -= start;
+    }
+    return rc < 0 ? -1 : records;
+}
+
+/* ---- Text packets ---- */
+
+int framer_process(struct packet_framer *framer, struct store_handle *handle)
+{
+    struct iovec iov[FRAMER_MAX_IOV];
+    int iovcnt = 0;
+    int packets = 0;
+    int rc = 0;
+    size_t start = 0;
+    int pipelined = 0;
+    char *newline;
+
+    if (!framer->negotiated && !framer_negotiate(framer, handle))
+        return 0;
+    if (handle->binary)
+        return framer_process_binary(framer, handle);
+
+    /* The caller drops the connection on an error: stop there */
+    while (rc == 0 &&
+           (newline = memchr(framer->buf + framer->scanned, '\n',
+                             framer->len - framer->scanned)) != NULL) {
+        size_t end = newline - framer->buf + 1;
+        char *packet = framer->buf + start;
+        size_t len = end - start;
+        struct aesd_seekto seek;
+
+        if (packet_is_seekto(packet, len, &seek)) {
+            if (framer_flush(framer, iov, &iovcnt) != 0)
+                rc = -1;
+            store_seekto(handle, seek.write_cmd, seek.write_cmd_offset);
+        } else if (packet_is_replay_request(packet, len, handle)) {
+            /* Flushed first: "since" and "new" count the batch before it */
+            if (framer_flush(framer, iov, &iovcnt) != 0)
+                rc = -1;
+        } else {
+#ifdef DEBUG
+            fprintf(stderr, "to file: %.*s", (int)len, packet);
+#endif
+            iov[iovcnt].iov_base = packet;
+            iov[iovcnt].iov_len = len;
+            if (++iovcnt == FRAMER_MAX_IOV && framer_flush(framer, iov, &iovcnt) != 0)
+                rc = -1;
+        }
+
+        packets++;
+        start = framer->scanned = end;
+
+        /* Keep-alive: one packet, one reply; the rest waits its turn */
+        if (handle->keepalive) {
+            pipelined = 1;
+            break;
+        }
+    }
+
+    if (framer_flush(framer, iov, &iovcnt) != 0)
+        rc = -1;
+
+    /* Keep only what was not handled; pipelined packets are not scanned yet */
+    if (start > 0) {
+        memmove(framer->buf, framer->buf + start, framer->len - start);
+        framer->len -= start;
+    }
+    framer->scanned = pipelined ? 0 : framer->len;
+
+    if (server_config.max_packet_size && !pipelined &&
+        framer->len > server_config.max_packet_size) {
+        syslog(LOG_WARNING, "packet longer than %zu bytes, dropping the connection",
+               server_config.max_packet_size);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return rc < 0 ? -1 : packets;
+}
+
+int framer_request_done(const struct packet_framer *framer, const struct store_handle *handle,
+                        int packets)
+{
+    if (handle->binary)
+        return packets > 0 && framer->reply_due;
+    return packets > 0 && (framer->len == 0 || handle->keepalive);
+}
+
+int framer_next_request(struct packet_framer *framer, struct store_handle *handle)
+{
+    int packets;
+
+    if (framer->len == 0)
+        return 0;
+    packets = framer_process(framer, handle);
+    if (packets < 0)
+        return -1;
+    return framer_request_done(framer, handle, packets);
+}
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Hot restart
+ *
+ *  - With --handoff PATH the running instance listens on the AF_UNIX
+ *    socket PATH for its successor. A new binary started with the same
+ *    PATH connects there instead of binding, receives the listening
+ *    sockets over SCM_RIGHTS and starts accepting on them: the kernel
+ *    keeps queueing connections the whole time, none is refused
+ *  - Once the successor has the listeners the old instance stops
+ *    accepting, drains its connections (at most HANDOFF_DRAIN_MS) and
+ *    then hands over its store: the memfd of the memory backend or the
+ *    open data file, plus the compressed block cache. The mmap backend
+ *    hands over nothing, the successor recovers the log from disk. The
+ *    char device keeps its own data
+ *  - Connections that reach the successor before the store has arrived
+ *    wait in the backlog, so nobody replays a half-empty store
+ *  - Only a peer running as the same user (or root) may take over
+ *  - With --reuseport only the first shard's listener is handed over;
+ *    set net.ipv4.tcp_migrate_req=1 so connections queued on the others
+ *    move to a live listener instead of being reset
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define HANDOFF_MAGIC "AESDHOFF"
+#define HANDOFF_VERSION 1
+#define HANDOFF_BACKEND_LEN 16
+/* How long the old instance waits for the successor to confirm */
+#define HANDOFF_ACK_TIMEOUT_S 5
+
+/* Old -> new: the listeners, which ride along as SCM_RIGHTS */
+struct handoff_hello {
+    char magic[8];
+    uint32_t version;
+    int32_t count;
+    int32_t tcp_index;      /* -1 = no TCP listener */
+    char unix_path[PATH_MAX];
+};
+
+/* Old -> new after draining, with the store fd when has_fd is set */
+struct handoff_store {
+    char magic[8];
+    char backend[HANDOFF_BACKEND_LEN];  /* "" = nothing handed over */
+    int64_t size;
+    int32_t has_fd;
+};
+
+/* Absolute, so it still resolves after daemonizing */
+static char handoff_path[PATH_MAX];
+
+static int handoff_listen_fd = -1;
+static pthread_t handoff_thread;
+static int handoff_started;
+
+/* Successor: the instance we took over from, until its store arrives */
+static int from_fd = -1;
+/* Old instance: the successor, until the store is handed over */
+static int to_fd = -1;
+
+static atomic_int draining;
+
+/* -------------------------------------------------------------------------
+ * Messages
+ * ----------------------------------------------------------------------*/
+
+int handoff_write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int handoff_read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* One message with nfds descriptors attached to its first byte */
+static int handoff_send_fds(int fd, const void *buf, size_t len, const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return -1;
+    /* The descriptors went with the first bytes; the rest is plain data */
+    return handoff_write_all(fd, (const char *)buf + n, len - n);
+}
+
+/* Returns the number of descriptors received, -1 on error */
+static int handoff_recv_fds(int fd, void *buf, size_t len, int *fds, int max_fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int count = 0;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        int i, nfds;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < nfds; i++) {
+            int received;
+
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (count < max_fds)
+                fds[count++] = received;
+            else
+                close(received);
+        }
+    }
+
+    if (n >= 0 && (size_t)n < len && !(msg.msg_flags & MSG_CTRUNC) &&
+        handoff_read_all(fd, (char *)buf + n, len - n) == 0)
+        n = len;
+
+    if (n != (ssize_t)len || (msg.msg_flags & MSG_CTRUNC)) {
+        while (count > 0)
+            close(fds[--count]);
+        if (n >= 0)
+            errno = EPROTO;
+        return -1;
+    }
+    return count;
+}
+
+/* -------------------------------------------------------------------------
+ * Successor
+ * ----------------------------------------------------------------------*/
+
+static int handoff_path_resolve(void)
+{
+    const char *path = server_config.handoff_path;
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    int len;
+
+    if (path[0] != '/' && !getcwd(cwd, sizeof(cwd)))
+        return -1;
+    len = path[0] != '/' ? snprintf(handoff_path, sizeof(handoff_path), "%s/%s", cwd, path)
+                         : snprintf(handoff_path, sizeof(handoff_path), "%s", path);
+
+    if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+        handoff_path[0] = '\0';
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int handoff_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, handoff_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_takeover(void)
+{
+    struct handoff_hello hello;
+    int fds[MAX_LISTENERS];
+    int fd, count;
+    char ack = 1;
+
+    if (handoff_path_resolve() != 0) {
+        syslog(LOG_ERR, "handoff socket %s: %s", server_config.handoff_path, strerror(errno));
+        return -1;
+    }
+
+    /* Nobody serving the path, or a stale socket file: start cold */
+    fd = handoff_connect();
+    if (fd < 0)
+        return 0;
+
+    count = handoff_recv_fds(fd, &hello, sizeof(hello), fds, MAX_LISTENERS);
+    if (count < 0) {
+        syslog(LOG_ERR, "handoff from %s: %s", handoff_path, strerror(errno));
+        goto fail;
+    }
+
+    hello.unix_path[sizeof(hello.unix_path) - 1] = '\0';
+    if (memcmp(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic)) != 0 ||
+        hello.version != HANDOFF_VERSION || hello.count != count ||
+        listeners_adopt(fds, count, hello.tcp_index, hello.unix_path) != 0) {
+        syslog(LOG_ERR, "handoff from %s: unexpected listeners", handoff_path);
+        while (count > 0)
+            close(fds[--count]);
+        goto fail;
+    }
+
+    /* From here on the old instance stops accepting */
+    if (handoff_write_all(fd, &ack, sizeof(ack)) != 0) {
+        syslog(LOG_ERR, "handoff from %s: %s", handoff_path, strerror(errno));
+        listeners_close();
+        goto fail;
+    }
+
+    from_fd = fd;
+    syslog(LOG_INFO, "hot restart: took over %d listener(s) from %s", count, handoff_path);
+    return 1;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+int handoff_store_init(void)
+{
+    struct handoff_store msg;
+    int fd = -1, rc;
+
+    if (from_fd < 0)
+        return store_init(server_config.store_backend);
+
+    /* Blocks while the old instance drains */
+    if (handoff_recv_fds(from_fd, &msg, sizeof(msg), &fd, 1) < 0 ||
+        memcmp(msg.magic, HANDOFF_MAGIC, sizeof(msg.magic)) != 0) {
+        syslog(LOG_WARNING, "hot restart: no store from %s, starting empty", handoff_path);
+        rc = store_init(server_config.store_backend);
+        goto out;
+    }
+
+    msg.backend[HANDOFF_BACKEND_LEN - 1] = '\0';
+    if (strcmp(msg.backend, server_config.store_backend) != 0) {
+        if (msg.backend[0])
+            syslog(LOG_WARNING, "hot restart: handed a %s store, running %s, starting empty",
+                   msg.backend, server_config.store_backend);
+        if (fd >= 0)
+            close(fd);
+        rc = store_init(server_config.store_backend);
+        goto out;
+    }
+
+    rc = store_init_handoff(msg.backend, msg.has_fd ? fd : -1, msg.size);
+    if (rc != 0 && fd >= 0)
+        close(fd);
+    if (rc == 0)
+        deflate_cache_import(from_fd, store_size());
+
+out:
+    close(from_fd);
+    from_fd = -1;
+    return rc;
+}
+
+int handoff_draining(void)
+{
+    return atomic_load(&draining);
+}
+
+/* -------------------------------------------------------------------------
+ * Old instance
+ * ----------------------------------------------------------------------*/
+
+/* Give the listeners to the peer on fd; 0 once it has confirmed */
+static int handoff_offer(int fd)
+{
+    struct timeval timeout = { .tv_sec = HANDOFF_ACK_TIMEOUT_S };
+    struct handoff_hello hello;
+    int fds[MAX_LISTENERS];
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    char ack;
+    int i;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+        (cred.uid != geteuid() && cred.uid != 0)) {
+        syslog(LOG_WARNING, "handoff refused to pid %d uid %u", (int)cred.pid,
+               (unsigned)cred.uid);
+        return -1;
+    }
+
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, HANDOFF_MAGIC, sizeof(hello.magic));
+    hello.version = HANDOFF_VERSION;
+    hello.count = listeners_count();
+    hello.tcp_index = listeners_tcp_index();
+    snprintf(hello.unix_path, sizeof(hello.unix_path), "%s", listeners_unix_path());
+    for (i = 0; i < hello.count; i++)
+        fds[i] = listeners_fd(i);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (handoff_send_fds(fd, &hello, sizeof(hello), fds, hello.count) != 0 ||
+        handoff_read_all(fd, &ack, sizeof(ack)) != 0) {
+        syslog(LOG_ERR, "handoff to pid %d: %s", (int)cred.pid, strerror(errno));
+        return -1;
+    }
+
+    timeout.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    syslog(LOG_INFO, "hot restart: listeners handed to pid %d, draining", (int)cred.pid);
+    return 0;
+}
+
+static void* handoff_server_main(void* arg)
+{
+    (void)arg;
+    while (1) {
+        int fd = accept4(handoff_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  /* shut down by handoff_server_stop() */
+        }
+
+        if (handoff_offer(fd) == 0) {
+            to_fd = fd;
+            listeners_disown();
+            atomic_store(&draining, 1);
+            /* The engines stop accepting and drain as on any shutdown */
+            kill(getpid(), SIGTERM);
+            break;
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int handoff_server_start(void)
+{
+    struct sockaddr_un addr;
+    sigset_t all_signals, old_mask;
+    int rc;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, handoff_path);
+
+    handoff_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_listen_fd < 0)
+        goto fail;
+
+    /* Replaces the old instance's socket file, or a stale one */
+    unlink(handoff_path);
+    if (bind(handoff_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        chmod(handoff_path, 0600) != 0 || listen(handoff_listen_fd, 1) != 0)
+        goto fail;
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    rc = pthread_create(&handoff_thread, NULL, handoff_server_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc != 0) {
+        errno = rc;
+        unlink(handoff_path);
+        goto fail;
+    }
+
+    handoff_started = 1;
+    syslog(LOG_INFO, "hot restart socket listening on %s", handoff_path);
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "handoff socket %s: %s", handoff_path, strerror(errno));
+    if (handoff_listen_fd != -1)
+        close(handoff_listen_fd);
+    handoff_listen_fd = -1;
+    return -1;
+}
+
+void handoff_server_stop(void)
+{
+    if (!handoff_started)
+        return;
+
+    /* Wakes the blocked accept(); an offer in progress finishes first */
+    shutdown(handoff_listen_fd, SHUT_RDWR);
+    pthread_join(handoff_thread, NULL);
+    close(handoff_listen_fd);
+    handoff_listen_fd = -1;
+    handoff_started = 0;
+
+    /* After a handoff the path is the successor's */
+    if (to_fd < 0)
+        unlink(handoff_path);
+}
+
+void handoff_finish(void)
+{
+    struct handoff_store msg;
+    const char *backend;
+    int fd = -1;
+    off_t size = 0;
+
+    /* A successor that failed before its store arrived */
+    if (from_fd >= 0) {
+        close(from_fd);
+        from_fd = -1;
+    }
+
+    if (to_fd < 0)
+        return;
+
+    memset(&msg, 0, sizeof(msg));
+    memcpy(msg.magic, HANDOFF_MAGIC, sizeof(msg.magic));
+    if (store_handoff_export(&backend, &fd, &size) == 0) {
+        snprintf(msg.backend, sizeof(msg.backend), "%s", backend);
+        msg.size = size;
+        msg.has_fd = fd >= 0;
+    }
+
+    if (handoff_send_fds(to_fd, &msg, sizeof(msg), &fd, msg.has_fd) != 0 ||
+        deflate_cache_export(to_fd) != 0)
+        syslog(LOG_ERR, "hot restart: store handoff: %s", strerror(errno));
+    else
+        syslog(LOG_INFO, "hot restart: %s store handed over, %lld bytes",
+               msg.backend[0] ? msg.backend : "no", (long long)size);
+
+    close(to_fd);
+    to_fd = -1;
+}
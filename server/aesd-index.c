@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Packet offset index
+ *
+ *  - One entry per write command of the file, mmap and memory backends:
+ *    the store offset just past that packet. AESDCHAR_IOCSEEKTO and
+ *    AESDREPLAY:since look a command up in constant time instead of
+ *    scanning the store for newlines
+ *  - The array is reserved up front with MAP_NORESERVE, like the memory
+ *    store, so it never moves: entries are written under the store
+ *    write lock and published with the count, lookups take no lock
+ *  - Built again from the store contents at startup, when a recovered
+ *    log or a hot restart brings packets along
+ *  - A store with more packets than PACKET_INDEX_RESERVE keeps working:
+ *    commands past the last entry are found by scanning from there
+ *  - The char device keeps its own entries and is not indexed
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+/* Most packets indexed; 8 bytes of address space each, pages on use */
+#if UINTPTR_MAX > 0xffffffffu
+#define PACKET_INDEX_RESERVE ((size_t)1 << 28)
+#else
+#define PACKET_INDEX_RESERVE ((size_t)1 << 22)
+#endif
+
+static uint64_t *index_ends;
+static atomic_size_t index_count;
+static int index_full;
+
+int packet_index_init(void)
+{
+    void *base = mmap(NULL, PACKET_INDEX_RESERVE * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "packet index: %s", strerror(errno));
+        return -1;
+    }
+    index_ends = base;
+    index_full = 0;
+    atomic_store(&index_count, 0);
+    return 0;
+}
+
+void packet_index_cleanup(void)
+{
+    if (!index_ends)
+        return;
+    munmap(index_ends, PACKET_INDEX_RESERVE * sizeof(uint64_t));
+    index_ends = NULL;
+    atomic_store(&index_count, 0);
+}
+
+/* Called with the store write lock held, after the packets are committed */
+void packet_index_append(off_t start, const struct iovec *iov, int iovcnt)
+{
+    size_t count = atomic_load_explicit(&index_count, memory_order_relaxed);
+    uint64_t end = start;
+    int i;
+
+    if (!index_ends)
+        return;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (count == PACKET_INDEX_RESERVE) {
+            if (!index_full)
+                syslog(LOG_WARNING, "packet index full at %zu packets, seeks past it scan",
+                       count);
+            index_full = 1;
+            break;
+        }
+        end += iov[i].iov_len;
+        index_ends[count++] = end;
+    }
+    atomic_store_explicit(&index_count, count, memory_order_release);
+}
+
+/* One pass over what the backend already holds */
+int packet_index_rebuild(struct store_handle *handle, store_read_fn raw_read, off_t size)
+{
+    struct store_replay scan;
+    char buf[BUFFER_SIZE * 4];
+    struct iovec iov;
+    off_t start = 0;
+    ssize_t n;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.end = size;
+    while (scan.pos < scan.end) {
+        char *p = buf, *nl;
+
+        n = raw_read(handle, &scan, buf, sizeof(buf));
+        if (n <= 0)
+            return -1;
+        while ((nl = memchr(p, '\n', buf + n - p)) != NULL) {
+            off_t end = scan.pos - n + (nl + 1 - buf);
+
+            iov.iov_len = end - start;
+            packet_index_append(start, &iov, 1);
+            start = end;
+            p = nl + 1;
+        }
+    }
+
+    if (size > 0)
+        syslog(LOG_INFO, "packet index: %zu packet(s) in %lld bytes",
+               packet_index_count(), (long long)size);
+    return 0;
+}
+
+size_t packet_index_count(void)
+{
+    return atomic_load_explicit(&index_count, memory_order_acquire);
+}
+
+int packet_index_full(void)
+{
+    return index_full;
+}
+
+/* Where write command write_cmd starts; the end of the last one past the index */
+off_t packet_index_start(size_t write_cmd)
+{
+    size_t count = packet_index_count();
+
+    if (write_cmd > count)
+        write_cmd = count;
+    return write_cmd ? (off_t)index_ends[write_cmd - 1] : 0;
+}
+
+int packet_index_lookup(size_t write_cmd, off_t *start, off_t *len)
+{
+    size_t count = packet_index_count();
+
+    if (write_cmd >= count) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *start = packet_index_start(write_cmd);
+    *len = index_ends[write_cmd] - *start;
+    return 0;
+}
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Listening sockets
+ *
+ *  - TCP on --port (SERVER_PORT), IPv4 only by default or one IPv6 dual-stack
+ *    socket with --ipv6, which takes IPv4 clients as mapped addresses
+ *  - An AF_UNIX stream socket with --unix, alongside TCP or, with
+ *    --no-tcp, instead of it. Local producers skip the TCP/IP stack
+ *  - Every listener feeds the same engines and the same protocol
+ *    handling; only the client name differs. IPv4-mapped clients are
+ *    named by their IPv4 address, so admission control treats them as
+ *    IPv4, and AF_UNIX clients by their user id ("unix:uid=N")
+ *  - server_socket_fd is the TCP listener, the one SO_REUSEPORT shards
+ *    copy; other listeners are shared by every loop
+ *  - A hot restart adopts the predecessor's listeners instead of binding
+ *    new ones: the same sockets, the same backlogs, nothing refused
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+static int listen_fds[MAX_LISTENERS];
+static int listen_count;
+
+/* Absolute, so it can still be unlinked after daemonizing */
+static char unix_path[PATH_MAX];
+
+/* Create a bound TCP listening socket for port, same family as the clients' */
+int tcp_listener_open(const char *port, int reuseport)
+{
+    struct addrinfo hints, *res;
+    int family = server_config.ipv6 ? AF_INET6 : AF_INET;
+    int optval = 1, v6only = 0;
+    int fd;
+
+    fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    /* Dual-stack whatever net.ipv6.bindv6only says */
+    if (family == AF_INET6 &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) != 0)
+        goto fail;
+
+    /* Every shard of the group must set it before bind */
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0)
+        goto fail;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    if (bind(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        freeaddrinfo(res);
+        goto fail;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+int server_listener_open(void)
+{
+    return tcp_listener_open(server_config.port, server_config.reuseport);
+}
+
+/* Bound AF_UNIX stream socket at server_config.unix_path, replacing a stale one */
+static int unix_listener_open(void)
+{
+    struct sockaddr_un addr;
+    const char *path = server_config.unix_path;
+    char cwd[PATH_MAX];
+    int fd, len;
+
+    if (path[0] != '/' && !getcwd(cwd, sizeof(cwd)))
+        return -1;
+    len = path[0] != '/' ? snprintf(unix_path, sizeof(unix_path), "%s/%s", cwd, path)
+                         : snprintf(unix_path, sizeof(unix_path), "%s", path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+        unix_path[0] = '\0';
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, unix_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    unlink(unix_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        unix_path[0] = '\0';
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listeners_open(void)
+{
+    int fd;
+
+    listen_count = 0;
+
+    if (server_config.tcp) {
+        server_socket_fd = server_listener_open();
+        if (server_socket_fd < 0) {
+            syslog(LOG_ERR, "TCP listener on port %s: %s", server_config.port, strerror(errno));
+            return -1;
+        }
+        listen_fds[listen_count++] = server_socket_fd;
+    }
+
+    if (server_config.unix_path) {
+        fd = unix_listener_open();
+        if (fd < 0) {
+            syslog(LOG_ERR, "unix listener %s: %s", server_config.unix_path, strerror(errno));
+            return -1;
+        }
+        listen_fds[listen_count++] = fd;
+    }
+    return 0;
+}
+
+int listeners_adopt(const int *fds, int count, int tcp_index, const char *path)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int i;
+
+    if (count < 1 || count > MAX_LISTENERS || tcp_index >= count ||
+        strlen(path) >= sizeof(unix_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        listen_fds[i] = fds[i];
+    listen_count = count;
+
+    /* What the predecessor listened on wins over our own options */
+    server_socket_fd = tcp_index >= 0 ? fds[tcp_index] : -1;
+    server_config.tcp = server_socket_fd >= 0;
+    if (server_socket_fd >= 0 &&
+        getsockname(server_socket_fd, (struct sockaddr*)&addr, &len) == 0)
+        server_config.ipv6 = addr.ss_family == AF_INET6;
+
+    strcpy(unix_path, path);
+    server_config.unix_path = unix_path[0] ? unix_path : NULL;
+    return 0;
+}
+
+/* The successor owns the AF_UNIX path now: closing must not unlink it */
+void listeners_disown(void)
+{
+    unix_path[0] = '\0';
+}
+
+const char *listeners_unix_path(void)
+{
+    return unix_path;
+}
+
+int listeners_tcp_index(void)
+{
+    int i;
+
+    for (i = 0; i < listen_count; i++) {
+        if (listen_fds[i] == server_socket_fd)
+            return i;
+    }
+    return -1;
+}
+
+int listeners_start(void)
+{
+    int i;
+
+    for (i = 0; i < listen_count; i++) {
+        if (listen(listen_fds[i], LISTEN_BACKLOG) != 0)
+            return -1;
+    }
+
+    syslog(LOG_INFO, "listening on%s%s%s%s",
+           server_config.tcp ? (server_config.ipv6 ? " tcp6:" : " tcp:") : "",
+           server_config.tcp ? server_config.port : "",
+           server_config.unix_path ? " unix:" : "",
+           server_config.unix_path ? unix_path : "");
+    return 0;
+}
+
+void listeners_close(void)
+{
+    int i;
+
+    for (i = 0; i < listen_count; i++)
+        close(listen_fds[i]);
+    listen_count = 0;
+    server_socket_fd = -1;
+
+    if (unix_path[0]) {
+        unlink(unix_path);
+        unix_path[0] = '\0';
+    }
+}
+
+int listeners_count(void)
+{
+    return listen_count;
+}
+
+int listeners_fd(int index)
+{
+    return listen_fds[index];
+}
+
+/* -------------------------------------------------------------------------
+ * Accepting
+ * ----------------------------------------------------------------------*/
+
+void client_addr_format(int fd, const struct sockaddr_storage *addr, char *name, size_t size)
+{
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    switch (addr->ss_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, name, size);
+        break;
+    case AF_INET6:
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+            inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], name, size);
+        else
+            inet_ntop(AF_INET6, &sin6->sin6_addr, name, size);
+        break;
+    case AF_UNIX:
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+            snprintf(name, size, "unix:uid=%u", (unsigned)cred.uid);
+        else
+            snprintf(name, size, "unix");
+        break;
+    default:
+        snprintf(name, size, "unknown");
+        break;
+    }
+}
+
+int listeners_accept(char *name, size_t size)
+{
+    struct pollfd fds[MAX_LISTENERS];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    sigset_t exit_signals, wait_mask;
+    int i, fd, rc;
+
+    for (i = 0; i < listen_count; i++) {
+        fds[i].fd = listen_fds[i];
+        fds[i].events = POLLIN;
+    }
+
+    /*
+     * EINTR goes back to the caller, which checks for shutdown. The exit
+     * signals are only let in inside ppoll, so one arriving just before
+     * it cannot leave us blocked with the flag already set.
+     */
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &exit_signals, &wait_mask);
+    if (exit_signal_flag) {
+        errno = EINTR;
+        rc = -1;
+    } else {
+        rc = ppoll(fds, listen_count, NULL, &wait_mask);
+    }
+    pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+    if (rc < 0)
+        return -1;
+
+    for (i = 0; i < listen_count; i++) {
+        if (!(fds[i].revents & POLLIN))
+            continue;
+
+        addr_len = sizeof(addr);
+        fd = accept4(listen_fds[i], (struct sockaddr*)&addr, &addr_len, SOCK_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        client_addr_format(fd, &addr, name, size);
+        return fd;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
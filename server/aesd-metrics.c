@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Server metrics
+ *
+ *  - Counters and histograms live in per-thread shards, each written by
+ *    its owning thread only: recording is a relaxed load and store, with
+ *    no lock and no shared cache line
+ *  - A shard outlives its thread: it is parked on exit and handed to
+ *    the next thread that starts, so thread-per-connection mode does
+ *    not allocate one per client
+ *  - Histograms are log-linear (8 sub-buckets per power of two, about
+ *    12% resolution); percentiles are computed when a snapshot is read
+ *  - The optional stats socket (--stats-socket) answers every connection
+ *    with one text snapshot and closes it
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define CACHELINE_SIZE 64
+
+/* Values below 2 * HIST_SUB get a bucket each, then HIST_SUB per octave */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum metrics_counter {
+    COUNTER_ACCEPTED,
+    COUNTER_CLOSED,
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+    COUNTER_PACKETS,
+    COUNTER_REPLAYS,
+    COUNTER_LOCK_WAIT_NS,
+    COUNTER_EVICTED_SLOW,
+    COUNTER_REJECTED,
+    COUNTER_RATE_LIMITED,
+    COUNTER_DEFLATE_IN,
+    COUNTER_DEFLATE_OUT,
+    COUNTER_DEFLATE_CACHE_HITS,
+    COUNTER_REPLICATION_BYTES,
+    COUNTER_PUSHED_BYTES,
+    COUNTER_SUBSCRIBERS_DROPPED,
+    COUNTER_SUBSCRIBERS_SKIPPED,
+    COUNTER_SKIPPED_BYTES,
+    COUNTER_KEEPALIVE_REPLIES,
+    COUNTER_IDLE_CLOSED,
+    COUNTER_STORE_SYNCS,
+    COUNTER_MAX
+};
+
+enum metrics_hist {
+    HIST_REQUEST_NS,
+    HIST_REPLAY_BYTES,
+    HIST_LOCK_WAIT_NS,
+    HIST_SYNC_NS,
+    HIST_MAX
+};
+
+struct metrics_shard {
+    _Atomic uint64_t counters[COUNTER_MAX];
+    _Atomic uint64_t hist[HIST_MAX][HIST_BUCKETS];
+    struct metrics_shard *next;         /* every shard ever created */
+    struct metrics_shard *next_free;    /* parked, guarded by free_lock */
+};
+
+static _Atomic(struct metrics_shard *) shard_list;
+static struct metrics_shard *free_list;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread struct metrics_shard *local_shard;
+
+static int stats_listen_fd = -1;
+static pthread_t stats_thread;
+static const char *stats_path;
+
+/* -------------------------------------------------------------------------
+ * Shards
+ * ----------------------------------------------------------------------*/
+
+static void metrics_shard_park(void *arg)
+{
+    struct metrics_shard *shard = arg;
+
+    pthread_mutex_lock(&free_lock);
+    shard->next_free = free_list;
+    free_list = shard;
+    pthread_mutex_unlock(&free_lock);
+}
+
+static void metrics_key_create(void)
+{
+    pthread_key_create(&shard_key, metrics_shard_park);
+}
+
+static struct metrics_shard *metrics_shard_acquire(void)
+{
+    struct metrics_shard *shard;
+
+    pthread_once(&shard_key_once, metrics_key_create);
+
+    pthread_mutex_lock(&free_lock);
+    shard = free_list;
+    if (shard)
+        free_list = shard->next_free;
+    pthread_mutex_unlock(&free_lock);
+
+    if (!shard) {
+        shard = aligned_alloc(CACHELINE_SIZE, sizeof(*shard));
+        if (!shard)
+            return NULL;
+        memset(shard, 0, sizeof(*shard));
+
+        shard->next = atomic_load(&shard_list);
+        while (!atomic_compare_exchange_weak(&shard_list, &shard->next, shard))
+            ;
+    }
+
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+static inline struct metrics_shard *metrics_shard(void)
+{
+    return local_shard ? local_shard : metrics_shard_acquire();
+}
+
+/* Only the owning thread writes a shard: no read-modify-write needed */
+static inline void metrics_add(_Atomic uint64_t *value, uint64_t n)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static unsigned hist_bucket(uint64_t value)
+{
+    unsigned exp;
+
+    if (value < 2 * HIST_SUB)
+        return value;
+
+    exp = 63 - __builtin_clzll(value);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls into bucket */
+static uint64_t hist_bucket_floor(unsigned bucket)
+{
+    unsigned exp;
+
+    if (bucket < 2 * HIST_SUB)
+        return bucket;
+
+    exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (exp - HIST_SUB_BITS);
+}
+
+static void metrics_record(enum metrics_counter counter, uint64_t n)
+{
+    struct metrics_shard *shard = metrics_shard();
+
+    if (shard)
+        metrics_add(&shard->counters[counter], n);
+}
+
+static void metrics_observe(enum metrics_hist hist, uint64_t value)
+{
+    struct metrics_shard *shard = metrics_shard();
+
+    if (shard)
+        metrics_add(&shard->hist[hist][hist_bucket(value)], 1);
+}
+
+/* -------------------------------------------------------------------------
+ * Recording
+ * ----------------------------------------------------------------------*/
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void metrics_conn_accepted(void)
+{
+    metrics_record(COUNTER_ACCEPTED, 1);
+}
+
+/* request_ns 0: the connection ended between keep-alive requests */
+void metrics_conn_closed(uint64_t request_ns)
+{
+    metrics_record(COUNTER_CLOSED, 1);
+    if (request_ns)
+        metrics_observe(HIST_REQUEST_NS, metrics_now_ns() - request_ns);
+}
+
+void metrics_request_done(uint64_t request_ns)
+{
+    metrics_record(COUNTER_KEEPALIVE_REPLIES, 1);
+    metrics_observe(HIST_REQUEST_NS, metrics_now_ns() - request_ns);
+}
+
+void metrics_idle_closed(void)
+{
+    metrics_record(COUNTER_IDLE_CLOSED, 1);
+}
+
+void metrics_bytes_in(size_t len)
+{
+    metrics_record(COUNTER_BYTES_IN, len);
+}
+
+void metrics_replay_done(size_t len)
+{
+    metrics_record(COUNTER_REPLAYS, 1);
+    metrics_record(COUNTER_BYTES_OUT, len);
+    metrics_observe(HIST_REPLAY_BYTES, len);
+}
+
+void metrics_packets_appended(unsigned count)
+{
+    metrics_record(COUNTER_PACKETS, count);
+}
+
+void metrics_lock_wait(uint64_t ns)
+{
+    metrics_record(COUNTER_LOCK_WAIT_NS, ns);
+    metrics_observe(HIST_LOCK_WAIT_NS, ns);
+}
+
+void metrics_slow_client_evicted(void)
+{
+    metrics_record(COUNTER_EVICTED_SLOW, 1);
+}
+
+void metrics_conn_rejected(void)
+{
+    metrics_record(COUNTER_REJECTED, 1);
+}
+
+void metrics_rate_limited(void)
+{
+    metrics_record(COUNTER_RATE_LIMITED, 1);
+}
+
+void metrics_deflate_block(size_t raw_len, size_t compressed_len, int cached)
+{
+    metrics_record(COUNTER_DEFLATE_IN, raw_len);
+    metrics_record(COUNTER_DEFLATE_OUT, compressed_len);
+    if (cached)
+        metrics_record(COUNTER_DEFLATE_CACHE_HITS, 1);
+}
+
+void metrics_replication_bytes(size_t len)
+{
+    metrics_record(COUNTER_REPLICATION_BYTES, len);
+}
+
+void metrics_bytes_pushed(size_t len)
+{
+    metrics_record(COUNTER_PUSHED_BYTES, len);
+}
+
+void metrics_subscriber_dropped(void)
+{
+    metrics_record(COUNTER_SUBSCRIBERS_DROPPED, 1);
+}
+
+void metrics_subscriber_skipped(uint64_t bytes)
+{
+    metrics_record(COUNTER_SUBSCRIBERS_SKIPPED, 1);
+    metrics_record(COUNTER_SKIPPED_BYTES, bytes);
+}
+
+void metrics_store_synced(uint64_t ns)
+{
+    metrics_record(COUNTER_STORE_SYNCS, 1);
+    metrics_observe(HIST_SYNC_NS, ns);
+}
+
+/* -------------------------------------------------------------------------
+ * Snapshots
+ * ----------------------------------------------------------------------*/
+
+struct metrics_snapshot {
+    uint64_t counters[COUNTER_MAX];
+    uint64_t hist[HIST_MAX][HIST_BUCKETS];
+};
+
+/* Sum all shards; each value is exact, the set is not atomic */
+static void metrics_collect(struct metrics_snapshot *snap)
+{
+    struct metrics_shard *shard;
+    int i, j;
+
+    memset(snap, 0, sizeof(*snap));
+    for (shard = atomic_load(&shard_list); shard; shard = shard->next) {
+        for (i = 0; i < COUNTER_MAX; i++)
+            snap->counters[i] += atomic_load_explicit(&shard->counters[i],
+                                                      memory_order_relaxed);
+        for (i = 0; i < HIST_MAX; i++) {
+            for (j = 0; j < HIST_BUCKETS; j++)
+                snap->hist[i][j] += atomic_load_explicit(&shard->hist[i][j],
+                                                         memory_order_relaxed);
+        }
+    }
+}
+
+/* Value at quantile q (per mille), reported as the bucket floor */
+static uint64_t hist_quantile(const uint64_t *buckets, unsigned q)
+{
+    uint64_t total = 0, rank, seen = 0;
+    unsigned i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += buckets[i];
+    if (total == 0)
+        return 0;
+
+    rank = (total * q + 999) / 1000;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return hist_bucket_floor(i);
+    }
+    return hist_bucket_floor(HIST_BUCKETS - 1);
+}
+
+static uint64_t hist_count(const uint64_t *buckets)
+{
+    uint64_t total = 0;
+    unsigned i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += buckets[i];
+    return total;
+}
+
+static size_t metrics_format_hist(char *buf, size_t size, const char *name,
+                                  const uint64_t *buckets, uint64_t divisor)
+{
+    int n = snprintf(buf, size,
+                     "%s_count %llu\n%s_p50 %llu\n%s_p99 %llu\n%s_p999 %llu\n",
+                     name, (unsigned long long)hist_count(buckets),
+                     name, (unsigned long long)(hist_quantile(buckets, 500) / divisor),
+                     name, (unsigned long long)(hist_quantile(buckets, 990) / divisor),
+                     name, (unsigned long long)(hist_quantile(buckets, 999) / divisor));
+
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size);
+}
+
+size_t metrics_format(char *buf, size_t size)
+{
+    struct metrics_snapshot *snap = malloc(sizeof(*snap));
+    uint64_t *c;
+    size_t len;
+    int n;
+
+    if (!snap)
+        return 0;
+    metrics_collect(snap);
+    c = snap->counters;
+
+    n = snprintf(buf, size,
+                 "connections_accepted %llu\n"
+                 "connections_active %llu\n"
+                 "bytes_in %llu\n"
+                 "bytes_out %llu\n"
+                 "packets_appended %llu\n"
+                 "replays %llu\n"
+                 "store_lock_wait_us_total %llu\n"
+                 "slow_clients_evicted %llu\n"
+                 "connections_rejected %llu\n"
+                 "clients_rate_limited %llu\n"
+                 "deflate_bytes_in %llu\n"
+                 "deflate_bytes_out %llu\n"
+                 "deflate_cache_hits %llu\n"
+                 "replication_bytes %llu\n"
+                 "pushed_bytes %llu\n"
+                 "subscribers_dropped %llu\n"
+                 "subscribers_skipped %llu\n"
+                 "subscriber_skipped_bytes %llu\n"
+                 "keepalive_replies %llu\n"
+                 "idle_connections_closed %llu\n"
+                 "store_syncs %llu\n",
+                 (unsigned long long)c[COUNTER_ACCEPTED],
+                 (unsigned long long)(c[COUNTER_ACCEPTED] > c[COUNTER_CLOSED] ?
+                                      c[COUNTER_ACCEPTED] - c[COUNTER_CLOSED] : 0),
+                 (unsigned long long)c[COUNTER_BYTES_IN],
+                 (unsigned long long)c[COUNTER_BYTES_OUT],
+                 (unsigned long long)c[COUNTER_PACKETS],
+                 (unsigned long long)c[COUNTER_REPLAYS],
+                 (unsigned long long)(c[COUNTER_LOCK_WAIT_NS] / 1000),
+                 (unsigned long long)c[COUNTER_EVICTED_SLOW],
+                 (unsigned long long)c[COUNTER_REJECTED],
+                 (unsigned long long)c[COUNTER_RATE_LIMITED],
+                 (unsigned long long)c[COUNTER_DEFLATE_IN],
+                 (unsigned long long)c[COUNTER_DEFLATE_OUT],
+                 (unsigned long long)c[COUNTER_DEFLATE_CACHE_HITS],
+                 (unsigned long long)c[COUNTER_REPLICATION_BYTES],
+                 (unsigned long long)c[COUNTER_PUSHED_BYTES],
+                 (unsigned long long)c[COUNTER_SUBSCRIBERS_DROPPED],
+                 (unsigned long long)c[COUNTER_SUBSCRIBERS_SKIPPED],
+                 (unsigned long long)c[COUNTER_SKIPPED_BYTES],
+                 (unsigned long long)c[COUNTER_KEEPALIVE_REPLIES],
+                 (unsigned long long)c[COUNTER_IDLE_CLOSED],
+                 (unsigned long long)c[COUNTER_STORE_SYNCS]);
+    len = n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size);
+    len += replication_metrics_format(buf + len, size - len);
+    len += pubsub_metrics_format(buf + len, size - len);
+
+    len += metrics_format_hist(buf + len, size - len, "request_latency_us",
+                               snap->hist[HIST_REQUEST_NS], 1000);
+    len += metrics_format_hist(buf + len, size - len, "replay_bytes",
+                               snap->hist[HIST_REPLAY_BYTES], 1);
+    len += metrics_format_hist(buf + len, size - len, "store_lock_wait_us",
+                               snap->hist[HIST_LOCK_WAIT_NS], 1000);
+    len += metrics_format_hist(buf + len, size - len, "store_sync_us",
+                               snap->hist[HIST_SYNC_NS], 1000);
+
+    free(snap);
+    return len;
+}
+
+/* -------------------------------------------------------------------------
+ * Stats socket
+ * ----------------------------------------------------------------------*/
+
+static void* metrics_server_main(void* arg)
+{
+    char report[METRICS_REPORT_SIZE];
+
+    (void)arg;
+    while (1) {
+        size_t len, off = 0;
+        int fd = accept4(stats_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  /* shut down by metrics_server_stop() */
+        }
+
+        len = metrics_format(report, sizeof(report));
+        while (off < len) {
+            ssize_t n = send(fd, report + off, len - off, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int metrics_server_start(const char *path)
+{
+    struct sockaddr_un addr;
+    sigset_t all_signals, old_mask;
+    int rc;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "stats socket path too long: %s", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    stats_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_listen_fd < 0)
+        goto fail;
+
+    unlink(path);
+    if (bind(stats_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(stats_listen_fd, 16) != 0)
+        goto fail;
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    rc = pthread_create(&stats_thread, NULL, metrics_server_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc != 0) {
+        errno = rc;
+        unlink(path);
+        goto fail;
+    }
+
+    stats_path = path;
+    syslog(LOG_INFO, "stats socket listening on %s", path);
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "stats socket %s: %s", path, strerror(errno));
+    if (stats_listen_fd != -1)
+        close(stats_listen_fd);
+    stats_listen_fd = -1;
+    return -1;
+}
+
+void metrics_server_stop(void)
+{
+    if (!stats_path)
+        return;
+
+    /* Wakes the blocked accept() */
+    shutdown(stats_listen_fd, SHUT_RDWR);
+    pthread_join(stats_thread, NULL);
+    close(stats_listen_fd);
+    stats_listen_fd = -1;
+
+    unlink(stats_path);
+    stats_path = NULL;
+}
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Memory-mapped, append-only packet log
+ *
+ *  - One long-lived descriptor; the file starts with a small header that
+ *    holds the committed length, followed by the packet bytes
+ *  - Space is preallocated in doubling steps and mapped into a virtual
+ *    range reserved up front, so the mapping never moves and readers
+ *    need no lock while the log grows
+ *  - Appends are a memcpy into the mapping followed by publishing the new
+ *    length; a process crash leaves at most an unpublished tail, which is
+ *    dropped when the log is reopened
+ *  - Nothing is msync'ed: the page cache writes the header and the data
+ *    back in any order, so the log survives process crashes only, not a
+ *    power loss or a kernel crash
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define MMAP_LOG_MAGIC "AESDLOG"
+#define MMAP_LOG_VERSION 1
+
+/* Address space reserved for the mapping: the largest log we can hold */
+#if UINTPTR_MAX > 0xffffffffu
+#define MMAP_LOG_RESERVE ((size_t)16 << 30)
+#else
+#define MMAP_LOG_RESERVE ((size_t)512 << 20)
+#endif
+
+#define MMAP_LOG_INITIAL_SIZE ((size_t)1 << 20)
+
+/* On-disk header, first bytes of the file */
+struct mmap_log_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t committed;     /* valid packet bytes after the header */
+};
+
+#define MMAP_LOG_DATA_OFFSET sizeof(struct mmap_log_header)
+
+static struct mmap_log_header *mmap_log_hdr(struct mmap_log *log)
+{
+    return (struct mmap_log_header *)log->base;
+}
+
+/* Preallocate the file to new_size and map the part not yet mapped */
+static int mmap_log_grow(struct mmap_log *log, size_t new_size)
+{
+    int err;
+
+    if (new_size > MMAP_LOG_RESERVE) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    err = posix_fallocate(log->fd, 0, new_size);
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+        errno = err;
+        return -1;
+    }
+    if (err != 0 && ftruncate(log->fd, new_size) != 0)
+        return -1;
+
+    if (mmap(log->base + log->mapped, new_size - log->mapped, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, log->fd, log->mapped) == MAP_FAILED)
+        return -1;
+
+    log->mapped = new_size;
+    return 0;
+}
+
+/* Validate an existing header; returns the committed length or -1 */
+static long long mmap_log_recover(struct mmap_log *log, off_t file_size)
+{
+    struct mmap_log_header *hdr = mmap_log_hdr(log);
+
+    if ((size_t)file_size < MMAP_LOG_DATA_OFFSET ||
+        memcmp(hdr->magic, MMAP_LOG_MAGIC, sizeof(MMAP_LOG_MAGIC)) != 0 ||
+        hdr->version != MMAP_LOG_VERSION ||
+        hdr->header_size != MMAP_LOG_DATA_OFFSET ||
+        hdr->committed > (uint64_t)file_size - MMAP_LOG_DATA_OFFSET)
+        return -1;
+
+    return (long long)hdr->committed;
+}
+
+int mmap_log_open(struct mmap_log *log, const char *path)
+{
+    struct stat st;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size;
+    long long recovered = -1;
+    void *reserve;
+
+    log->base = NULL;
+    log->mapped = 0;
+    atomic_init(&log->committed, 0);
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd < 0 || fstat(log->fd, &st) != 0)
+        goto fail;
+
+    reserve = mmap(NULL, MMAP_LOG_RESERVE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED)
+        goto fail;
+    log->base = reserve;
+
+    /* Map what is already on disk, at least the initial preallocation */
+    size = MMAP_LOG_INITIAL_SIZE;
+    while (size < (size_t)st.st_size)
+        size *= 2;
+    size = (size + page - 1) & ~(page - 1);
+    if (mmap_log_grow(log, size) != 0)
+        goto fail;
+
+    if (st.st_size > 0)
+        recovered = mmap_log_recover(log, st.st_size);
+
+    if (recovered < 0) {
+        struct mmap_log_header *hdr = mmap_log_hdr(log);
+
+        if (st.st_size > 0)
+            syslog(LOG_WARNING, "%s: no valid log header, starting empty", path);
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, MMAP_LOG_MAGIC, sizeof(MMAP_LOG_MAGIC));
+        hdr->version = MMAP_LOG_VERSION;
+        hdr->header_size = MMAP_LOG_DATA_OFFSET;
+        recovered = 0;
+    } else {
+        syslog(LOG_INFO, "%s: recovered %lld committed bytes", path, recovered);
+    }
+
+    atomic_store(&log->committed, (size_t)recovered);
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "mmap log %s: %s", path, strerror(errno));
+    mmap_log_close(log);
+    return -1;
+}
+
+void mmap_log_close(struct mmap_log *log)
+{
+    if (log->base) {
+        munmap(log->base, MMAP_LOG_RESERVE);
+        log->base = NULL;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+        log->fd = -1;
+    }
+    log->mapped = 0;
+}
+
+int mmap_log_appendv(struct mmap_log *log, const struct iovec *iov, int iovcnt)
+{
+    size_t committed = atomic_load_explicit(&log->committed, memory_order_relaxed);
+    size_t total = 0;
+    size_t needed;
+    char *dst;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    needed = MMAP_LOG_DATA_OFFSET + committed + total;
+    if (needed > log->mapped) {
+        size_t new_size = log->mapped * 2;
+
+        while (new_size < needed)
+            new_size *= 2;
+        if (mmap_log_grow(log, new_size) != 0) {
+            syslog(LOG_ERR, "mmap log grow to %zu: %s", new_size, strerror(errno));
+            return -1;
+        }
+    }
+
+    dst = log->base + MMAP_LOG_DATA_OFFSET + committed;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+
+    /*
+     * Data first, then the length: the header never covers bytes this
+     * process has not written. Writeback keeps no such order on disk
+     */
+    __atomic_store_n(&mmap_log_hdr(log)->committed, (uint64_t)(committed + total),
+                     __ATOMIC_RELEASE);
+    atomic_store_explicit(&log->committed, committed + total, memory_order_release);
+    return 0;
+}
+
+size_t mmap_log_committed(struct mmap_log *log)
+{
+    return atomic_load_explicit(&log->committed, memory_order_acquire);
+}
+
+const char *mmap_log_data(struct mmap_log *log)
+{
+    return log->base + MMAP_LOG_DATA_OFFSET;
+}
+
+off_t mmap_log_data_offset(void)
+{
+    return MMAP_LOG_DATA_OFFSET;
+}
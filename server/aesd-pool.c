@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Worker pool execution engine for aesdsocket
+ *
+ *  - Fixed number of worker threads created at startup
+ *  - Main thread accepts and pushes connections onto a bounded
+ *    lock-free MPMC queue (Vyukov ring); semaphores only park threads
+ *    when the queue is empty or full
+ *  - Saturation counters logged on SIGUSR1 and at shutdown
+ *  - Shutdown serves everything already queued; after a hot restart
+ *    only for HANDOFF_DRAIN_MS, then the remaining clients are cut off
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define CACHELINE_SIZE 64
+
+/* One accepted connection; client_fd == -1 tells a worker to exit */
+struct pool_job {
+    int client_fd;
+    uint64_t accepted_ns;
+    struct admission_slot *admission;
+    char client_ip[CLIENT_ADDR_LEN];
+};
+
+struct job_cell {
+    atomic_size_t sequence;
+    struct pool_job job;
+};
+
+/* Bounded MPMC ring: cells carry a sequence number instead of a lock */
+struct job_queue {
+    struct job_cell *cells;
+    size_t mask;
+    _Alignas(CACHELINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHELINE_SIZE) atomic_size_t dequeue_pos;
+    sem_t items;    /* published jobs */
+    sem_t slots;    /* free cells */
+};
+
+/* Saturation counters */
+struct pool_stats {
+    atomic_uint busy_workers;
+    atomic_size_t queue_depth;
+    atomic_size_t queue_high_water;
+    atomic_ulong dispatched;
+    atomic_ulong queue_full_waits;  /* acceptor blocked on a full queue */
+};
+
+static struct job_queue job_queue;
+static struct pool_stats pool_stats;
+static int pool_num_workers;
+
+/* Client each worker is serving, -1 = none; for the end of a drain */
+static atomic_int *worker_fds;
+static atomic_int drain_expired;
+
+/* -------------------------------------------------------------------------
+ * Job queue
+ * ----------------------------------------------------------------------*/
+
+static int job_queue_init(struct job_queue *q, size_t depth)
+{
+    size_t capacity = 2;
+    size_t i;
+
+    while (capacity < depth)
+        capacity <<= 1;
+
+    q->cells = calloc(capacity, sizeof(struct job_cell));
+    if (!q->cells)
+        return -1;
+
+    for (i = 0; i < capacity; i++)
+        atomic_init(&q->cells[i].sequence, i);
+
+    q->mask = capacity - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    sem_init(&q->items, 0, 0);
+    sem_init(&q->slots, 0, capacity);
+    return 0;
+}
+
+static void job_queue_destroy(struct job_queue *q)
+{
+    sem_destroy(&q->items);
+    sem_destroy(&q->slots);
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/* Returns 0 on success, -1 if the ring is full */
+static int job_queue_try_push(struct job_queue *q, const struct pool_job *job)
+{
+    struct job_cell *cell;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    while (1) {
+        size_t seq;
+        intptr_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->job = *job;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+/* Returns 0 on success, -1 if the ring is empty */
+static int job_queue_try_pop(struct job_queue *q, struct pool_job *job)
+{
+    struct job_cell *cell;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    while (1) {
+        size_t seq;
+        intptr_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *job = cell->job;
+    atomic_store_explicit(&cell->sequence, pos + q->mask + 1, memory_order_release);
+    return 0;
+}
+
+/* Blocking push: waits for a free cell, counting the waits */
+static void job_queue_push(struct job_queue *q, const struct pool_job *job)
+{
+    size_t depth, high;
+
+    if (sem_trywait(&q->slots) != 0) {
+        atomic_fetch_add_explicit(&pool_stats.queue_full_waits, 1, memory_order_relaxed);
+        while (sem_wait(&q->slots) != 0)
+            ;
+    }
+
+    /* A slot is reserved, so the ring cannot be full */
+    while (job_queue_try_push(q, job) != 0)
+        ;
+
+    depth = atomic_fetch_add_explicit(&pool_stats.queue_depth, 1, memory_order_relaxed) + 1;
+    high = atomic_load_explicit(&pool_stats.queue_high_water, memory_order_relaxed);
+    while (depth > high &&
+           !atomic_compare_exchange_weak_explicit(&pool_stats.queue_high_water, &high, depth,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    sem_post(&q->items);
+}
+
+static void job_queue_pop(struct job_queue *q, struct pool_job *job)
+{
+    while (sem_wait(&q->items) != 0)
+        ;
+
+    /* An item is reserved; it may still be in the middle of publishing */
+    while (job_queue_try_pop(q, job) != 0)
+        ;
+
+    atomic_fetch_sub_explicit(&pool_stats.queue_depth, 1, memory_order_relaxed);
+    sem_post(&q->slots);
+}
+
+/* -------------------------------------------------------------------------
+ * Workers
+ * ----------------------------------------------------------------------*/
+
+static void* pool_worker_main(void* arg)
+{
+    atomic_int *current = arg;
+    struct pool_job job;
+
+    while (1) {
+        job_queue_pop(&job_queue, &job);
+        if (job.client_fd < 0)
+            break;
+
+        atomic_fetch_add_explicit(&pool_stats.busy_workers, 1, memory_order_relaxed);
+        atomic_store(current, job.client_fd);
+        if (!atomic_load(&drain_expired))
+            client_session_run(job.client_fd, job.client_ip, job.admission, job.accepted_ns);
+        atomic_store(current, -1);
+        atomic_fetch_sub_explicit(&pool_stats.busy_workers, 1, memory_order_relaxed);
+
+        close(job.client_fd);
+        admission_release(job.admission);
+        syslog(LOG_INFO, "Closed connection from %s", job.client_ip);
+    }
+
+    return NULL;
+}
+
+/* Wait for queued and running clients, cutting them off at the deadline */
+static void pool_drain(void)
+{
+    uint64_t deadline = metrics_now_ns() + (uint64_t)HANDOFF_DRAIN_MS * 1000000u;
+    int i;
+
+    while ((atomic_load(&pool_stats.busy_workers) > 0 ||
+            atomic_load(&pool_stats.queue_depth) > 0) && metrics_now_ns() < deadline)
+        usleep(10000);
+
+    /* Queued jobs left are closed unserved, running sessions see EOF */
+    atomic_store(&drain_expired, 1);
+    for (i = 0; i < pool_num_workers; i++) {
+        int fd = atomic_load(&worker_fds[i]);
+
+        if (fd >= 0)
+            shutdown(fd, SHUT_RDWR);
+    }
+}
+
+static void pool_log_stats(void)
+{
+    syslog(LOG_INFO,
+           "pool: workers=%d busy=%u queue=%zu/%zu high_water=%zu dispatched=%lu full_waits=%lu",
+           pool_num_workers,
+           atomic_load(&pool_stats.busy_workers),
+           atomic_load(&pool_stats.queue_depth),
+           job_queue.mask + 1,
+           atomic_load(&pool_stats.queue_high_water),
+           atomic_load(&pool_stats.dispatched),
+           atomic_load(&pool_stats.queue_full_waits));
+}
+
+/* -------------------------------------------------------------------------
+ * Acceptor
+ * ----------------------------------------------------------------------*/
+
+int pool_server_run(void)
+{
+    pthread_t *workers;
+    sigset_t all_signals, old_mask;
+    struct pool_job job;
+    int started = 0;
+    int i;
+
+    pool_num_workers = server_config.num_workers;
+    if (pool_num_workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool_num_workers = cpus > 0 ? (int)cpus : 1;
+    }
+
+    workers = calloc(pool_num_workers, sizeof(pthread_t));
+    worker_fds = malloc(pool_num_workers * sizeof(*worker_fds));
+    if (!workers || !worker_fds ||
+        job_queue_init(&job_queue, server_config.queue_depth) != 0) {
+        syslog(LOG_ERR, "worker pool: %s", strerror(errno));
+        free(workers);
+        free(worker_fds);
+        return -1;
+    }
+    for (i = 0; i < pool_num_workers; i++)
+        atomic_init(&worker_fds[i], -1);
+
+    /* Workers never see signals: the accept in this thread gets the EINTR */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    for (i = 0; i < pool_num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, pool_worker_main, &worker_fds[i]) != 0)
+            break;
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (started != pool_num_workers)
+        syslog(LOG_ERR, "worker pool: started %d of %d workers", started, pool_num_workers);
+    else
+        syslog(LOG_INFO, "worker pool running %d worker(s), queue depth %zu",
+               pool_num_workers, job_queue.mask + 1);
+
+    while (started == pool_num_workers && !exit_signal_flag) {
+        int new_fd;
+
+        if (stats_dump_flag) {
+            stats_dump_flag = 0;
+            pool_log_stats();
+        }
+
+        new_fd = listeners_accept(job.client_ip, sizeof(job.client_ip));
+        if (new_fd < 0)
+            continue;
+
+        /* Turned away before it takes a queue cell */
+        if (admission_acquire(job.client_ip, &job.admission) != 0) {
+            close(new_fd);
+            continue;
+        }
+
+        job.client_fd = new_fd;
+        job.accepted_ns = metrics_now_ns();
+        metrics_conn_accepted();
+        syslog(LOG_INFO, "Accepted connection from %s", job.client_ip);
+
+        job_queue_push(&job_queue, &job);
+        atomic_fetch_add_explicit(&pool_stats.dispatched, 1, memory_order_relaxed);
+    }
+
+    if (handoff_draining())
+        pool_drain();
+
+    /* Queued connections are still served: the exit jobs go in last */
+    job.client_fd = -1;
+    job.client_ip[0] = '\0';
+    for (i = 0; i < started; i++)
+        job_queue_push(&job_queue, &job);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    pool_log_stats();
+
+    job_queue_destroy(&job_queue);
+    free(workers);
+    free(worker_fds);
+    worker_fds = NULL;
+
+    return started == pool_num_workers ? 0 : -1;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Subscriptions
+ *
+ *  - AESDREPLAY:subscribe keeps the connection open after its replay:
+ *    every packet appended from then on is pushed to it. It combines
+ *    with the other AESDREPLAY requests, e.g. new + subscribe pushes
+ *    new packets only
+ *  - Appends are copied once into a shared ring (--subscribe-ring) under
+ *    the store write lock, so the ring holds the newest bytes in store
+ *    order. Each subscriber is just a cursor into it: one append fans
+ *    out to any number of subscribers with no copy per subscriber
+ *  - The engine hands the socket over once the replay is sent; one
+ *    thread pushes from the ring to every subscriber, non-blocking, and
+ *    is woken by appends through an eventfd
+ *  - A subscriber the ring has lapped is dropped, or with
+ *    --subscriber-lag skip moved to the end of the ring, to resume with
+ *    the next append; what it missed is lost. Appends never wait for it
+ *  - The ring is written without waiting for readers: a send that races
+ *    the writer past its cursor is detected after the fact and drops
+ *    the subscriber, since the bytes it got may be torn
+ *  - Ring positions are store offsets, so pushes continue exactly where
+ *    the replay stopped. The char device has no stable offsets: there a
+ *    subscriber starts with the next append
+ *  - Pushed packets are never compressed, so a deflate replay cannot
+ *    subscribe
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define PUBSUB_MAX_EVENTS 64
+
+struct subscriber {
+    int fd;
+    char name[CLIENT_ADDR_LEN];
+    uint64_t cursor;            /* next ring position to send */
+    int blocked;                /* socket full, waiting for EPOLLOUT */
+    int dead;                   /* dropped, freed after the event batch */
+    struct subscriber *prev;
+    struct subscriber *next;
+};
+
+/* The ring; positions are absolute, byte p lives at ring[p % ring_size] */
+static char *ring;
+static size_t ring_size;
+static _Atomic uint64_t ring_head;      /* end of the published bytes */
+static _Atomic uint64_t ring_reserved;  /* end of the bytes being written */
+
+static pthread_t pubsub_thread;
+static int pubsub_started;
+static int pubsub_epoll_fd = -1;
+static int pubsub_wake_fd = -1;
+static atomic_int pubsub_wake_pending;
+static atomic_int pubsub_stopping;
+static int wake_marker;
+
+/* Linked by engine threads, unlinked by the pubsub thread */
+static pthread_mutex_t subscribers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct subscriber *subscribers;
+static struct subscriber *graveyard;
+static atomic_int subscriber_count;
+
+/* -------------------------------------------------------------------------
+ * Publishing
+ * ----------------------------------------------------------------------*/
+
+static void ring_copy(uint64_t pos, const char *data, size_t len)
+{
+    size_t off, first;
+
+    /* Only the last ring_size bytes of a long write survive anyway */
+    if (len > ring_size) {
+        data += len - ring_size;
+        pos += len - ring_size;
+        len = ring_size;
+    }
+
+    off = pos % ring_size;
+    first = len < ring_size - off ? len : ring_size - off;
+    memcpy(ring + off, data, first);
+    memcpy(ring, data + first, len - first);
+}
+
+/* Called with the store write lock held, after the packets are committed */
+void pubsub_publish(const struct iovec *iov, int iovcnt)
+{
+    uint64_t head, pos;
+    size_t total = 0;
+    int i;
+
+    if (!ring)
+        return;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+
+    /* Readers check this after sending: it covers bytes about to change */
+    atomic_store(&ring_reserved, head + total);
+    for (i = 0, pos = head; i < iovcnt; pos += iov[i].iov_len, i++)
+        ring_copy(pos, iov[i].iov_base, iov[i].iov_len);
+    atomic_store_explicit(&ring_head, head + total, memory_order_release);
+
+    if (atomic_load_explicit(&subscriber_count, memory_order_relaxed) > 0 &&
+        !atomic_exchange(&pubsub_wake_pending, 1))
+        eventfd_write(pubsub_wake_fd, 1);
+}
+
+/* -------------------------------------------------------------------------
+ * Pushing
+ * ----------------------------------------------------------------------*/
+
+/* Called by the pubsub thread only, lock held */
+static void subscriber_drop(struct subscriber *sub, const char *why)
+{
+    syslog(LOG_INFO, "Closed subscriber %s: %s", sub->name, why);
+    epoll_ctl(pubsub_epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+    close(sub->fd);
+
+    if (sub->prev)
+        sub->prev->next = sub->next;
+    else
+        subscribers = sub->next;
+    if (sub->next)
+        sub->next->prev = sub->prev;
+
+    sub->dead = 1;
+    sub->next = graveyard;
+    graveyard = sub;
+    atomic_fetch_sub(&subscriber_count, 1);
+}
+
+/* Send what the subscriber has not seen yet; -1 when it had to be dropped */
+static int subscriber_flush(struct subscriber *sub)
+{
+    while (!sub->blocked) {
+        uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+        uint64_t lag = atomic_load(&ring_reserved) - sub->cursor;
+        size_t off, len;
+        ssize_t n;
+
+        if (sub->cursor >= head)
+            return 0;
+
+        if (lag > ring_size) {
+            if (!server_config.subscriber_skip) {
+                metrics_subscriber_dropped();
+                subscriber_drop(sub, "fell behind the subscribe ring");
+                return -1;
+            }
+            /* The head is always a packet boundary */
+            metrics_subscriber_skipped(head - sub->cursor);
+            syslog(LOG_WARNING, "Subscriber %s fell behind, skipping %llu bytes", sub->name,
+                   (unsigned long long)(head - sub->cursor));
+            sub->cursor = head;
+            return 0;
+        }
+
+        off = sub->cursor % ring_size;
+        len = head - sub->cursor;
+        if (len > ring_size - off)
+            len = ring_size - off;
+
+        n = send(sub->fd, ring + off, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sub->blocked = 1;
+                return 0;
+            }
+            subscriber_drop(sub, strerror(errno));
+            return -1;
+        }
+
+        /* The writer reached these bytes while the kernel copied them */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&ring_reserved) - sub->cursor > ring_size) {
+            metrics_subscriber_dropped();
+            subscriber_drop(sub, "overrun by the writer while sending");
+            return -1;
+        }
+
+        sub->cursor += n;
+        metrics_bytes_pushed(n);
+    }
+    return 0;
+}
+
+/*
+ * Subscribers only listen: whatever they send is discarded. A half-close
+ * is how the usual client ends its request, so EOF keeps it subscribed;
+ * a client that is gone fails the next push.
+ */
+static int subscriber_discard_input(struct subscriber *sub)
+{
+    char buf[BUFFER_SIZE];
+
+    while (1) {
+        ssize_t n = recv(sub->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        subscriber_drop(sub, strerror(errno));
+        return -1;
+    }
+}
+
+static void* pubsub_main(void* arg)
+{
+    struct epoll_event events[PUBSUB_MAX_EVENTS];
+
+    (void)arg;
+    while (!atomic_load(&pubsub_stopping)) {
+        struct subscriber *sub, *next;
+        int i, n = epoll_wait(pubsub_epoll_fd, events, PUBSUB_MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "subscriptions: epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&subscribers_lock);
+        for (i = 0; i < n; i++) {
+            uint32_t ev = events[i].events;
+
+            if (events[i].data.ptr == &wake_marker) {
+                eventfd_t value;
+
+                /* Cleared before reading the head: a later append wakes us again */
+                atomic_store(&pubsub_wake_pending, 0);
+                eventfd_read(pubsub_wake_fd, &value);
+                for (sub = subscribers; sub; sub = next) {
+                    next = sub->next;
+                    subscriber_flush(sub);
+                }
+                continue;
+            }
+
+            sub = events[i].data.ptr;
+            if (sub->dead)
+                continue;
+            if (ev & (EPOLLERR | EPOLLHUP)) {
+                subscriber_drop(sub, "connection lost");
+                continue;
+            }
+            if ((ev & (EPOLLIN | EPOLLRDHUP)) && subscriber_discard_input(sub) != 0)
+                continue;
+            if (ev & EPOLLOUT) {
+                sub->blocked = 0;
+                subscriber_flush(sub);
+            }
+        }
+
+        while (graveyard) {
+            sub = graveyard;
+            graveyard = sub->next;
+            free(sub);
+        }
+        pthread_mutex_unlock(&subscribers_lock);
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------
+ * Public API
+ * ----------------------------------------------------------------------*/
+
+int pubsub_start(void)
+{
+    struct epoll_event ev;
+    sigset_t all_signals, old_mask;
+    void *base;
+    int rc;
+
+    if (server_config.subscribe_ring == 0)
+        return 0;
+
+    ring_size = server_config.subscribe_ring;
+    base = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pubsub_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pubsub_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (base == MAP_FAILED || pubsub_epoll_fd < 0 || pubsub_wake_fd < 0)
+        goto fail;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_marker;
+    if (epoll_ctl(pubsub_epoll_fd, EPOLL_CTL_ADD, pubsub_wake_fd, &ev) != 0)
+        goto fail;
+
+    /* Ring positions follow the store offsets from here on */
+    atomic_store(&ring_head, store_is_device() ? 0 : (uint64_t)store_size());
+    atomic_store(&ring_reserved, atomic_load(&ring_head));
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    rc = pthread_create(&pubsub_thread, NULL, pubsub_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc != 0) {
+        errno = rc;
+        goto fail;
+    }
+
+    /* Published last: appends start filling the ring now */
+    ring = base;
+    pubsub_started = 1;
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "subscriptions: %s", strerror(errno));
+    if (base != MAP_FAILED)
+        munmap(base, ring_size);
+    if (pubsub_epoll_fd >= 0)
+        close(pubsub_epoll_fd);
+    if (pubsub_wake_fd >= 0)
+        close(pubsub_wake_fd);
+    pubsub_epoll_fd = pubsub_wake_fd = -1;
+    return -1;
+}
+
+/* After the engines stopped: no more appends or subscriptions */
+void pubsub_stop(void)
+{
+    if (!pubsub_started)
+        return;
+
+    atomic_store(&pubsub_stopping, 1);
+    eventfd_write(pubsub_wake_fd, 1);
+    pthread_join(pubsub_thread, NULL);
+
+    while (subscribers)
+        subscriber_drop(subscribers, "server shutting down");
+    while (graveyard) {
+        struct subscriber *sub = graveyard;
+
+        graveyard = sub->next;
+        free(sub);
+    }
+
+    close(pubsub_epoll_fd);
+    close(pubsub_wake_fd);
+    pubsub_epoll_fd = pubsub_wake_fd = -1;
+    munmap(ring, ring_size);
+    ring = NULL;
+    pubsub_started = 0;
+}
+
+int pubsub_subscribe(int client_fd, const char *client_ip, const struct store_handle *handle)
+{
+    struct subscriber *sub;
+    struct epoll_event ev;
+    uint64_t head, cursor;
+
+    if (!ring) {
+        syslog(LOG_WARNING, "%s asked to subscribe, subscriptions are disabled", client_ip);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (handle->deflate) {
+        syslog(LOG_WARNING, "%s asked to subscribe to a compressed replay", client_ip);
+        errno = EINVAL;
+        return -1;
+    }
+
+    sub = calloc(1, sizeof(*sub));
+    if (!sub)
+        return -1;
+
+    /* The engine closes its descriptor as usual, this one stays */
+    sub->fd = fcntl(client_fd, F_DUPFD_CLOEXEC, 0);
+    if (sub->fd < 0) {
+        free(sub);
+        return -1;
+    }
+    fcntl(sub->fd, F_SETFL, fcntl(sub->fd, F_GETFL) | O_NONBLOCK);
+    snprintf(sub->name, sizeof(sub->name), "%s", client_ip);
+
+    /* Right after the replay's last byte, or with the next append */
+    head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    cursor = !store_is_device() && handle->subscribe_from >= 0 ?
+             (uint64_t)handle->subscribe_from : head;
+    sub->cursor = cursor;
+
+    pthread_mutex_lock(&subscribers_lock);
+    sub->next = subscribers;
+    if (sub->next)
+        sub->next->prev = sub;
+    subscribers = sub;
+    atomic_fetch_add(&subscriber_count, 1);
+
+    /* Edge-triggered EPOLLOUT fires once now: the first flush */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = sub;
+    if (epoll_ctl(pubsub_epoll_fd, EPOLL_CTL_ADD, sub->fd, &ev) != 0) {
+        subscribers = sub->next;
+        if (sub->next)
+            sub->next->prev = NULL;
+        atomic_fetch_sub(&subscriber_count, 1);
+        pthread_mutex_unlock(&subscribers_lock);
+        close(sub->fd);
+        free(sub);
+        return -1;
+    }
+    pthread_mutex_unlock(&subscribers_lock);
+
+    syslog(LOG_INFO, "Subscribed %s at offset %llu", client_ip, (unsigned long long)cursor);
+    return 0;
+}
+
+size_t pubsub_metrics_format(char *buf, size_t size)
+{
+    int n;
+
+    if (!pubsub_started)
+        return 0;
+    n = snprintf(buf, size, "subscribers %d\n", atomic_load(&subscriber_count));
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size);
+}
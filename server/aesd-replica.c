@@ -0,0 +1,721 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Replication
+ *
+ *  - A primary started with --replication-port serves replicas there. A
+ *    replica (--replica-of HOST:PORT) connects, says how much of the
+ *    store it already has, and receives everything after that: first
+ *    the catch-up snapshot, then every append as it is committed. It is
+ *    one byte stream, so the replica's store offsets, write commands and
+ *    packet index match the primary's
+ *  - Each replica has a thread on the primary. Appends wake it through
+ *    an eventfd, at most one wakeup pending per replica; when idle it
+ *    sends a heartbeat every REPL_HEARTBEAT_MS
+ *  - Frames carry the primary's committed size and clock, so the replica
+ *    knows its lag in bytes and how old its newest data is. It acks what
+ *    it applied, which gives the primary its own view of the lag. Both
+ *    are in the metrics snapshot
+ *  - Replicas are read-only: clients get replays, a data packet drops the
+ *    connection. The replica reconnects on its own and resumes where its
+ *    store ends; that also holds after a hot restart or a recovered log
+ *  - Replica lag in time compares the two hosts' clocks, which therefore
+ *    need to be synchronized; on one host it is exact
+ *  - The char device drops old entries, so offsets do not last: neither
+ *    side of replication runs on it
+ *  - The file and mmap backends use one fixed path, so a primary and a
+ *    replica on the same host need the memory backend on one of them
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <endian.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define REPL_MAGIC "AESDREPL"
+#define REPL_VERSION 1
+#define REPL_CHUNK (64 * 1024)
+#define REPL_HEARTBEAT_MS 1000
+/* A primary silent for this long is gone: reconnect */
+#define REPL_SILENCE_MS (3 * REPL_HEARTBEAT_MS)
+#define REPL_RETRY_MS 1000
+/* Packets appended per store_appendv() call */
+#define REPL_MAX_IOV 64
+
+/* Replica -> primary, once; all integers big-endian */
+struct repl_hello {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t from;          /* bytes the replica already holds */
+};
+
+/* Primary -> replica, followed by len bytes of store from offset */
+struct repl_frame {
+    uint64_t offset;
+    uint64_t primary_size;  /* committed on the primary when sent */
+    uint64_t sent_ns;       /* CLOCK_REALTIME on the primary */
+    uint32_t len;           /* 0 = heartbeat */
+    uint32_t reserved;
+};
+
+/* -------------------------------------------------------------------------
+ * Shared helpers
+ * ----------------------------------------------------------------------*/
+
+static uint64_t repl_wall_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int repl_read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Thread with every signal blocked: they belong to the main thread */
+static int repl_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all_signals, old_mask;
+    int rc;
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    rc = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Primary
+ * ----------------------------------------------------------------------*/
+
+struct repl_session {
+    pthread_t thread;
+    int fd;
+    int wake_fd;                /* eventfd: appends, shutdown */
+    atomic_int wake_pending;    /* a wakeup is already queued */
+    atomic_int finished;
+    atomic_llong acked;         /* bytes the replica applied */
+    size_t ack_len;             /* start of an ack split across reads, */
+    char ack_buf[sizeof(uint64_t)];     /* kept until the rest arrives */
+    char name[CLIENT_ADDR_LEN];
+    struct repl_session *next;
+};
+
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct repl_session *sessions;
+static atomic_int session_count;
+static atomic_int primary_stopping;
+
+static int repl_listen_fd = -1;
+static pthread_t repl_accept_thread;
+static int primary_started;
+
+static void repl_session_wake(struct repl_session *session)
+{
+    if (!atomic_exchange(&session->wake_pending, 1))
+        eventfd_write(session->wake_fd, 1);
+}
+
+void replication_notify(void)
+{
+    struct repl_session *session;
+
+    if (atomic_load_explicit(&session_count, memory_order_relaxed) == 0)
+        return;
+
+    pthread_mutex_lock(&sessions_lock);
+    for (session = sessions; session; session = session->next)
+        repl_session_wake(session);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+static int repl_send_frame(struct repl_session *session, uint64_t offset, uint64_t size,
+                           const char *data, size_t len)
+{
+    struct repl_frame frame;
+    struct iovec iov[2];
+
+    memset(&frame, 0, sizeof(frame));
+    frame.offset = htobe64(offset);
+    frame.primary_size = htobe64(size);
+    frame.sent_ns = htobe64(repl_wall_ns());
+    frame.len = htobe32(len);
+
+    iov[0].iov_base = &frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return store_writev_all(session->fd, iov, len ? 2 : 1);
+}
+
+/* Ship everything from *pos to the current end of the store */
+static int repl_send_store(struct repl_session *session, off_t *pos, char *buf)
+{
+    struct store_handle handle;
+    struct store_replay replay;
+    ssize_t n = 0;
+
+    if (store_open(&handle) != 0)
+        return -1;
+    store_replay_from(&handle, *pos);
+    store_replay_begin(&handle, &replay);
+
+    while ((n = store_replay_read(&handle, &replay, buf, REPL_CHUNK)) > 0) {
+        if (repl_send_frame(session, *pos, replay.end, buf, n) != 0) {
+            n = -1;
+            break;
+        }
+        *pos += n;
+        metrics_replication_bytes(n);
+    }
+
+    store_replay_end(&replay);
+    store_close(&handle);
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * Take in whatever acks arrived; 0 when the replica closed. Acks are 8
+ * bytes but the stream may split them: a partial one waits in ack_buf.
+ */
+static int repl_read_acks(struct repl_session *session)
+{
+    char buf[16 * sizeof(uint64_t)];
+    uint64_t ack;
+    size_t whole;
+    ssize_t n;
+
+    memcpy(buf, session->ack_buf, session->ack_len);
+    n = recv(session->fd, buf + session->ack_len, sizeof(buf) - session->ack_len,
+             MSG_DONTWAIT);
+    if (n <= 0)
+        return n < 0 && (errno == EAGAIN || errno == EINTR) ? 1 : 0;
+
+    n += session->ack_len;
+    whole = n / sizeof(ack) * sizeof(ack);
+    if (whole > 0) {
+        memcpy(&ack, buf + whole - sizeof(ack), sizeof(ack));
+        atomic_store(&session->acked, (long long)be64toh(ack));
+    }
+    session->ack_len = n - whole;
+    memcpy(session->ack_buf, buf + whole, session->ack_len);
+    return 1;
+}
+
+static void* repl_session_main(void* arg)
+{
+    struct repl_session *session = arg;
+    struct timeval timeout = { .tv_sec = REPL_SILENCE_MS / 1000 };
+    struct repl_hello hello;
+    char *buf = malloc(REPL_CHUNK);
+    off_t pos;
+
+    setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!buf || repl_read_all(session->fd, &hello, sizeof(hello)) != 0 ||
+        memcmp(hello.magic, REPL_MAGIC, sizeof(hello.magic)) != 0 ||
+        be32toh(hello.version) != REPL_VERSION) {
+        syslog(LOG_WARNING, "replica %s: bad hello", session->name);
+        goto out;
+    }
+
+    pos = be64toh(hello.from);
+    if (pos > store_size()) {
+        syslog(LOG_ERR, "replica %s holds %lld bytes, more than this primary",
+               session->name, (long long)pos);
+        goto out;
+    }
+    atomic_store(&session->acked, pos);
+    syslog(LOG_INFO, "replica %s connected at offset %lld", session->name, (long long)pos);
+
+    while (!atomic_load(&primary_stopping)) {
+        struct pollfd fds[2];
+        eventfd_t value;
+        int rc;
+
+        /* Cleared before reading the size: a later append wakes us again */
+        atomic_store(&session->wake_pending, 0);
+        if (pos < store_size() && repl_send_store(session, &pos, buf) != 0)
+            break;
+
+        fds[0].fd = session->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = session->wake_fd;
+        fds[1].events = POLLIN;
+        rc = poll(fds, 2, REPL_HEARTBEAT_MS);
+        if (rc < 0 && errno != EINTR)
+            break;
+        if (rc == 0 && repl_send_frame(session, pos, store_size(), NULL, 0) != 0)
+            break;
+        if (rc > 0 && (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) &&
+            !repl_read_acks(session))
+            break;
+        if (rc > 0 && (fds[1].revents & POLLIN))
+            eventfd_read(session->wake_fd, &value);
+    }
+
+    syslog(LOG_INFO, "replica %s disconnected at offset %lld", session->name, (long long)pos);
+out:
+    free(buf);
+    atomic_store(&session->finished, 1);
+    return NULL;
+}
+
+/* Reap sessions whose replica went away; lock held */
+static void repl_sessions_reap(int all)
+{
+    struct repl_session **link = &sessions;
+
+    while (*link) {
+        struct repl_session *session = *link;
+
+        if (!all && !atomic_load(&session->finished)) {
+            link = &session->next;
+            continue;
+        }
+
+        /* Wakes a session blocked in send or poll */
+        shutdown(session->fd, SHUT_RDWR);
+        eventfd_write(session->wake_fd, 1);
+        pthread_join(session->thread, NULL);
+        close(session->fd);
+        close(session->wake_fd);
+        *link = session->next;
+        free(session);
+        atomic_fetch_sub(&session_count, 1);
+    }
+}
+
+static void* repl_accept_main(void* arg)
+{
+    (void)arg;
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        struct repl_session *session;
+        int one = 1;
+        int fd = accept4(repl_listen_fd, (struct sockaddr*)&addr, &addr_len, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;  /* shut down by replication_stop() */
+        }
+
+        pthread_mutex_lock(&sessions_lock);
+        repl_sessions_reap(0);
+        pthread_mutex_unlock(&sessions_lock);
+
+        session = calloc(1, sizeof(*session));
+        if (!session) {
+            close(fd);
+            continue;
+        }
+        session->fd = fd;
+        session->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        client_addr_format(fd, &addr, session->name, sizeof(session->name));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (server_config.send_timeout_ms > 0) {
+            struct timeval tv = {
+                .tv_sec = server_config.send_timeout_ms / 1000,
+                .tv_usec = (server_config.send_timeout_ms % 1000) * 1000,
+            };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+
+        pthread_mutex_lock(&sessions_lock);
+        if (session->wake_fd < 0 ||
+            repl_thread_create(&session->thread, repl_session_main, session) != 0) {
+            pthread_mutex_unlock(&sessions_lock);
+            syslog(LOG_ERR, "replica %s: %s", session->name, strerror(errno));
+            if (session->wake_fd >= 0)
+                close(session->wake_fd);
+            close(fd);
+            free(session);
+            continue;
+        }
+        session->next = sessions;
+        sessions = session;
+        atomic_fetch_add(&session_count, 1);
+        pthread_mutex_unlock(&sessions_lock);
+    }
+
+    return NULL;
+}
+
+int replication_server_start(void)
+{
+    const char *port = server_config.replication_port;
+
+    if (store_is_device()) {
+        syslog(LOG_ERR, "replication needs stable store offsets, not the %s backend",
+               server_config.store_backend);
+        return -1;
+    }
+
+    repl_listen_fd = tcp_listener_open(port, 0);
+    if (repl_listen_fd < 0 || listen(repl_listen_fd, 16) != 0 ||
+        repl_thread_create(&repl_accept_thread, repl_accept_main, NULL) != 0) {
+        syslog(LOG_ERR, "replication port %s: %s", port, strerror(errno));
+        if (repl_listen_fd >= 0)
+            close(repl_listen_fd);
+        repl_listen_fd = -1;
+        return -1;
+    }
+
+    primary_started = 1;
+    syslog(LOG_INFO, "serving replicas on port %s", port);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Replica
+ * ----------------------------------------------------------------------*/
+
+static pthread_t replica_thread;
+static int replica_started;
+static int replica_stop_fd = -1;        /* eventfd: interrupts the retry wait */
+static atomic_int replica_stopping;
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+static int replica_fd = -1;             /* guarded by replica_lock */
+
+static atomic_int replica_connected;
+static _Atomic uint64_t replica_lag_bytes;
+static _Atomic uint64_t replica_lag_us;
+
+/* "host:port" or "[v6 address]:port" */
+static int replica_parse_target(char *host, size_t size, const char **port)
+{
+    const char *target = server_config.replica_of;
+    const char *colon = strrchr(target, ':');
+    size_t len;
+
+    if (!colon || colon == target || !colon[1])
+        return -1;
+    len = colon - target;
+    if (target[0] == '[' && target[len - 1] == ']') {
+        target++;
+        len -= 2;
+    }
+    if (len == 0 || len >= size)
+        return -1;
+    memcpy(host, target, len);
+    host[len] = '\0';
+    *port = colon + 1;
+    return 0;
+}
+
+static int replica_connect(void)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    const char *port;
+    int fd = -1, one = 1;
+
+    if (replica_parse_target(host, sizeof(host), &port) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Append the complete packets at the front of buf; returns the bytes used */
+static int replica_apply(const char *buf, size_t len, size_t *used)
+{
+    struct iovec iov[REPL_MAX_IOV];
+    size_t start = 0;
+    int iovcnt = 0;
+    const char *nl;
+
+    while ((nl = memchr(buf + start, '\n', len - start)) != NULL) {
+        size_t end = nl - buf + 1;
+
+        iov[iovcnt].iov_base = (void *)(buf + start);
+        iov[iovcnt].iov_len = end - start;
+        start = end;
+        if (++iovcnt == REPL_MAX_IOV) {
+            if (store_appendv(iov, iovcnt) != 0)
+                return -1;
+            iovcnt = 0;
+        }
+    }
+    if (iovcnt > 0 && store_appendv(iov, iovcnt) != 0)
+        return -1;
+
+    *used = start;
+    return 0;
+}
+
+/* One connection to the primary, until it fails or we stop */
+static void replica_session(int fd)
+{
+    struct timeval timeout = { .tv_sec = REPL_SILENCE_MS / 1000 };
+    struct repl_hello hello;
+    struct iovec iov;
+    char *buf = NULL;
+    size_t have = 0, cap = 0;
+    uint64_t received = store_size();
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, REPL_MAGIC, sizeof(hello.magic));
+    hello.version = htobe32(REPL_VERSION);
+    hello.from = htobe64(received);
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    if (store_writev_all(fd, &iov, 1) != 0)
+        return;
+
+    atomic_store(&replica_connected, 1);
+    syslog(LOG_INFO, "replicating from %s at offset %llu", server_config.replica_of,
+           (unsigned long long)received);
+
+    while (!atomic_load(&replica_stopping)) {
+        struct repl_frame frame;
+        uint64_t primary_size, sent_ns, now_ns, ack;
+        size_t len, used;
+
+        if (repl_read_all(fd, &frame, sizeof(frame)) != 0)
+            break;
+        len = be32toh(frame.len);
+        primary_size = be64toh(frame.primary_size);
+        sent_ns = be64toh(frame.sent_ns);
+        if (be64toh(frame.offset) != received) {
+            syslog(LOG_ERR, "replication stream out of step: offset %llu, expected %llu",
+                   (unsigned long long)be64toh(frame.offset), (unsigned long long)received);
+            break;
+        }
+
+        if (len > 0) {
+            if (have + len > cap) {
+                char *grown = realloc(buf, have + len);
+
+                if (!grown)
+                    break;
+                buf = grown;
+                cap = have + len;
+            }
+            if (repl_read_all(fd, buf + have, len) != 0)
+                break;
+            have += len;
+            received += len;
+
+            /* A packet split across frames waits for its tail */
+            if (replica_apply(buf, have, &used) != 0)
+                break;
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            metrics_replication_bytes(len);
+        }
+
+        now_ns = repl_wall_ns();
+        atomic_store(&replica_lag_bytes, primary_size > received ? primary_size - received : 0);
+        atomic_store(&replica_lag_us, now_ns > sent_ns ? (now_ns - sent_ns) / 1000 : 0);
+
+        ack = htobe64(store_size());
+        iov.iov_base = &ack;
+        iov.iov_len = sizeof(ack);
+        if (store_writev_all(fd, &iov, 1) != 0)
+            break;
+    }
+
+    atomic_store(&replica_connected, 0);
+    free(buf);
+}
+
+static void* replica_main(void* arg)
+{
+    struct pollfd stop = { .fd = replica_stop_fd, .events = POLLIN };
+
+    (void)arg;
+    while (!atomic_load(&replica_stopping)) {
+        int fd = replica_connect();
+
+        if (fd >= 0) {
+            pthread_mutex_lock(&replica_lock);
+            replica_fd = fd;
+            pthread_mutex_unlock(&replica_lock);
+
+            replica_session(fd);
+
+            pthread_mutex_lock(&replica_lock);
+            replica_fd = -1;
+            pthread_mutex_unlock(&replica_lock);
+            close(fd);
+            if (!atomic_load(&replica_stopping))
+                syslog(LOG_WARNING, "lost the primary %s, reconnecting",
+                       server_config.replica_of);
+        }
+
+        poll(&stop, 1, REPL_RETRY_MS);
+    }
+
+    return NULL;
+}
+
+int replica_start(void)
+{
+    char host[256];
+    const char *port;
+
+    if (replica_parse_target(host, sizeof(host), &port) != 0) {
+        syslog(LOG_ERR, "replica of %s: expected HOST:PORT", server_config.replica_of);
+        return -1;
+    }
+    if (store_is_device()) {
+        syslog(LOG_ERR, "replication needs stable store offsets, not the %s backend",
+               server_config.store_backend);
+        return -1;
+    }
+
+    replica_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (replica_stop_fd < 0 ||
+        repl_thread_create(&replica_thread, replica_main, NULL) != 0) {
+        syslog(LOG_ERR, "replica: %s", strerror(errno));
+        if (replica_stop_fd >= 0)
+            close(replica_stop_fd);
+        replica_stop_fd = -1;
+        return -1;
+    }
+
+    replica_started = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Both
+ * ----------------------------------------------------------------------*/
+
+void replication_stop(void)
+{
+    if (primary_started) {
+        atomic_store(&primary_stopping, 1);
+        /* Wakes the blocked accept() */
+        shutdown(repl_listen_fd, SHUT_RDWR);
+        pthread_join(repl_accept_thread, NULL);
+        close(repl_listen_fd);
+        repl_listen_fd = -1;
+
+        pthread_mutex_lock(&sessions_lock);
+        repl_sessions_reap(1);
+        pthread_mutex_unlock(&sessions_lock);
+        primary_started = 0;
+    }
+
+    if (replica_started) {
+        atomic_store(&replica_stopping, 1);
+        eventfd_write(replica_stop_fd, 1);
+        pthread_mutex_lock(&replica_lock);
+        if (replica_fd >= 0)
+            shutdown(replica_fd, SHUT_RDWR);
+        pthread_mutex_unlock(&replica_lock);
+        pthread_join(replica_thread, NULL);
+        close(replica_stop_fd);
+        replica_stop_fd = -1;
+        replica_started = 0;
+    }
+}
+
+size_t replication_metrics_format(char *buf, size_t size)
+{
+    struct repl_session *session;
+    uint64_t lag, max_lag = 0;
+    off_t committed;
+    int n, replicas = 0;
+
+    if (primary_started) {
+        committed = store_size();
+        pthread_mutex_lock(&sessions_lock);
+        for (session = sessions; session; session = session->next) {
+            if (atomic_load(&session->finished))
+                continue;
+            replicas++;
+            lag = committed - atomic_load(&session->acked);
+            if (lag > max_lag)
+                max_lag = lag;
+        }
+        pthread_mutex_unlock(&sessions_lock);
+
+        n = snprintf(buf, size, "replicas_connected %d\nreplica_max_lag_bytes %llu\n",
+                     replicas, (unsigned long long)max_lag);
+    } else if (replica_started) {
+        n = snprintf(buf, size,
+                     "replica_connected %d\nreplication_lag_bytes %llu\n"
+                     "replication_lag_us %llu\n",
+                     atomic_load(&replica_connected),
+                     (unsigned long long)atomic_load(&replica_lag_bytes),
+                     (unsigned long long)atomic_load(&replica_lag_us));
+    } else {
+        return 0;
+    }
+
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size);
+}
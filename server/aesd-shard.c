@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Listener shards for the event loop engines
+ *
+ *  - One shard per loop thread; a shard is the listener the loop accepts
+ *    from plus its accept counter
+ *  - Without --reuseport every shard uses server_socket_fd, the TCP
+ *    listener; other listeners are never sharded
+ *  - With --reuseport each shard has its own SO_REUSEPORT listener, so
+ *    the kernel spreads connections across them, and its loop thread is
+ *    pinned to one of the CPUs the process may run on
+ *  - Accept counters are per shard, cacheline-separated, logged on
+ *    SIGUSR1 and at shutdown to show the spread
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#define CACHELINE_SIZE 64
+
+struct listen_shard {
+    _Alignas(CACHELINE_SIZE) atomic_ulong accepted;
+    int fd;
+    int cpu;                /* -1 = not pinned */
+};
+
+static struct listen_shard *shards;
+static int shard_count;
+
+/* The n-th CPU in the process affinity mask, wrapping around */
+static int shard_cpu(int n)
+{
+    cpu_set_t allowed;
+    int count, cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+
+    count = CPU_COUNT(&allowed);
+    if (count == 0)
+        return -1;
+    n %= count;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+int shards_init(int count)
+{
+    int i;
+
+    shards = calloc(count, sizeof(struct listen_shard));
+    if (!shards)
+        return -1;
+    shard_count = count;
+
+    for (i = 0; i < count; i++) {
+        shards[i].cpu = -1;
+        shards[i].fd = server_socket_fd;
+    }
+
+    /* Only TCP is sharded; without it there is nothing to copy */
+    for (i = 0; i < count && server_config.reuseport && server_socket_fd >= 0; i++) {
+        shards[i].cpu = shard_cpu(i);
+
+        /* Shard 0 keeps the listener bound before daemonizing */
+        if (i == 0)
+            continue;
+
+        shards[i].fd = server_listener_open();
+        if (shards[i].fd < 0 || listen(shards[i].fd, LISTEN_BACKLOG) != 0) {
+            syslog(LOG_ERR, "listener shard %d: %s", i, strerror(errno));
+            shards_cleanup();
+            return -1;
+        }
+    }
+
+    if (server_config.reuseport && server_socket_fd >= 0)
+        syslog(LOG_INFO, "%d SO_REUSEPORT listener shard(s)", count);
+    return 0;
+}
+
+void shards_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < shard_count; i++) {
+        if (shards[i].fd >= 0 && shards[i].fd != server_socket_fd)
+            close(shards[i].fd);
+    }
+
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
+
+int shard_listen_fd(int shard)
+{
+    return shards[shard].fd;
+}
+
+void shard_pin_thread(int shard)
+{
+    cpu_set_t cpus;
+    int rc;
+
+    if (shards[shard].cpu < 0)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(shards[shard].cpu, &cpus);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0)
+        syslog(LOG_WARNING, "pin shard %d to cpu %d: %s", shard, shards[shard].cpu,
+               strerror(rc));
+}
+
+void shard_count_accept(int shard)
+{
+    atomic_fetch_add_explicit(&shards[shard].accepted, 1, memory_order_relaxed);
+}
+
+void shards_log_stats(void)
+{
+    char line[512];
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < shard_count && len < sizeof(line); i++) {
+        int n = snprintf(line + len, sizeof(line) - len, " %d:%lu", i,
+                         atomic_load_explicit(&shards[i].accepted, memory_order_relaxed));
+        if (n < 0)
+            break;
+        len += n;
+    }
+    syslog(LOG_INFO, "shards: accepted%s", len ? line : " -");
+}
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Connection memory
+ *
+ *  - Connection objects come from slabs: chunks of same-sized objects
+ *    carved up front and kept on a free list, so accepting a client
+ *    costs no malloc once the slab has warmed up. A slab belongs to the
+ *    thread that accepts and frees its objects and takes no lock
+ *  - Receive buffers are recycled between connections through one
+ *    small cache: a connection starts with the buffer the previous one
+ *    grew, and buffers grown past RXBUF_CACHE_MAX_CAP by a large packet
+ *    go back to the allocator instead of pinning memory
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+/* --- POSIX / system headers --- */
+#include <pthread.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+/* Idle receive buffers kept for the next connections */
+#define RXBUF_CACHE_MAX 64
+#define RXBUF_CACHE_MAX_CAP (64 * 1024)
+
+/* Header of each chunk; the objects follow, aligned for any type */
+struct slab_chunk {
+    struct slab_chunk *next;
+    max_align_t align[];
+};
+
+/* Free objects are linked through their first bytes */
+struct slab_free_obj {
+    struct slab_free_obj *next;
+};
+
+struct rxbuf {
+    char *buf;
+    size_t cap;
+};
+
+static pthread_mutex_t rxbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rxbuf rxbuf_cache[RXBUF_CACHE_MAX];
+static int rxbuf_cached;
+
+/* -------------------------------------------------------------------------
+ * Object slabs
+ * ----------------------------------------------------------------------*/
+
+void slab_init(struct obj_slab *slab, size_t obj_size, unsigned per_chunk)
+{
+    size_t align = _Alignof(max_align_t);
+
+    if (obj_size < sizeof(struct slab_free_obj))
+        obj_size = sizeof(struct slab_free_obj);
+    slab->obj_size = (obj_size + align - 1) / align * align;
+    slab->per_chunk = per_chunk ? per_chunk : 1;
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+}
+
+static int slab_grow(struct obj_slab *slab)
+{
+    struct slab_chunk *chunk;
+    char *obj;
+    unsigned i;
+
+    chunk = malloc(sizeof(*chunk) + slab->obj_size * slab->per_chunk);
+    if (!chunk)
+        return -1;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    obj = (char *)chunk->align;
+    for (i = 0; i < slab->per_chunk; i++, obj += slab->obj_size) {
+        struct slab_free_obj *free_obj = (struct slab_free_obj *)obj;
+
+        free_obj->next = slab->free_list;
+        slab->free_list = free_obj;
+    }
+    return 0;
+}
+
+void *slab_alloc(struct obj_slab *slab)
+{
+    struct slab_free_obj *obj;
+
+    if (!slab->free_list && slab_grow(slab) != 0)
+        return NULL;
+
+    obj = slab->free_list;
+    slab->free_list = obj->next;
+    memset(obj, 0, slab->obj_size);
+    return obj;
+}
+
+void slab_free(struct obj_slab *slab, void *ptr)
+{
+    struct slab_free_obj *obj = ptr;
+
+    if (!obj)
+        return;
+    obj->next = slab->free_list;
+    slab->free_list = obj;
+}
+
+/* Every object goes with it, whether it was freed or not */
+void slab_destroy(struct obj_slab *slab)
+{
+    while (slab->chunks) {
+        struct slab_chunk *next = slab->chunks->next;
+
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    slab->free_list = NULL;
+}
+
+/* -------------------------------------------------------------------------
+ * Receive buffers
+ * ----------------------------------------------------------------------*/
+
+char *rxbuf_get(size_t *cap)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&rxbuf_lock);
+    if (rxbuf_cached > 0) {
+        rxbuf_cached--;
+        buf = rxbuf_cache[rxbuf_cached].buf;
+        *cap = rxbuf_cache[rxbuf_cached].cap;
+    }
+    pthread_mutex_unlock(&rxbuf_lock);
+
+    if (!buf) {
+        buf = malloc(RXBUF_INITIAL_CAP);
+        *cap = buf ? RXBUF_INITIAL_CAP : 0;
+    }
+    return buf;
+}
+
+void rxbuf_put(char *buf, size_t cap)
+{
+    if (!buf)
+        return;
+
+    if (cap <= RXBUF_CACHE_MAX_CAP) {
+        pthread_mutex_lock(&rxbuf_lock);
+        if (rxbuf_cached < RXBUF_CACHE_MAX) {
+            rxbuf_cache[rxbuf_cached].buf = buf;
+            rxbuf_cache[rxbuf_cached].cap = cap;
+            rxbuf_cached++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&rxbuf_lock);
+    }
+    free(buf);
+}
+
+void rxbuf_cache_drain(void)
+{
+    pthread_mutex_lock(&rxbuf_lock);
+    while (rxbuf_cached > 0) {
+        rxbuf_cached--;
+        free(rxbuf_cache[rxbuf_cached].buf);
+    }
+    pthread_mutex_unlock(&rxbuf_lock);
+}
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Store backend: aesdchar character device
+ *
+ *  - The driver owns the data and keeps the last entries in its
+ *    circular buffer; one entry per write call
+ *  - One shared descriptor for appends, one per client for reads since
+ *    the driver keeps the AESDCHAR_IOCSEEKTO position per open file
+ *  - Zero-copy replays splice device -> pipe -> socket
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
+
+/* Shared append descriptor */
+static int chardev_write_fd = -1;
+
+static int chardev_init(void)
+{
+    chardev_write_fd = open(AESDCHAR_PATH, O_WRONLY | O_CLOEXEC);
+    if (chardev_write_fd < 0) {
+        syslog(LOG_ERR, "open %s: %s", AESDCHAR_PATH, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void chardev_cleanup(void)
+{
+    if (chardev_write_fd != -1) {
+        close(chardev_write_fd);
+        chardev_write_fd = -1;
+    }
+}
+
+static int chardev_open(struct store_handle *handle)
+{
+    handle->fd = open(AESDCHAR_PATH, O_RDONLY | O_CLOEXEC);
+    if (handle->fd < 0) {
+        syslog(LOG_ERR, "open %s: %s", AESDCHAR_PATH, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void chardev_close(struct store_handle *handle)
+{
+    if (handle->fd != -1)
+        close(handle->fd);
+}
+
+/* writev reaches the driver as one write per iovec: one entry per packet */
+static int chardev_appendv(const struct iovec *iov, int iovcnt)
+{
+    if (store_writev_all(chardev_write_fd, iov, iovcnt) != 0) {
+        syslog(LOG_ERR, "write %s: %s", AESDCHAR_PATH, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The driver returns the new position on success and a positive EINVAL
+ * for a command or offset it does not hold, which a valid position may
+ * also equal. Starting from 0, only a seek that worked leaves the file
+ * position at the value returned.
+ */
+static int chardev_seekto(struct store_handle *handle, unsigned int write_cmd,
+                          unsigned int write_cmd_offset)
+{
+    struct aesd_seekto seek;
+    off_t pos;
+    long ret;
+
+    if (lseek(handle->fd, 0, SEEK_SET) != 0)
+        return -1;
+
+    seek.write_cmd = write_cmd;
+    seek.write_cmd_offset = write_cmd_offset;
+    ret = ioctl(handle->fd, AESDCHAR_IOCSEEKTO, &seek);
+    if (ret < 0)
+        return -1;
+
+    pos = lseek(handle->fd, 0, SEEK_CUR);
+    if (pos < 0)
+        return -1;
+    if (pos != ret) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Bytes currently held by the circular buffer */
+static off_t chardev_size(void)
+{
+    return lseek(chardev_write_fd, 0, SEEK_END);
+}
+
+/* Replay positions are relative: pos counts the bytes read so far */
+static void chardev_replay_begin(struct store_handle *handle, struct store_replay *replay)
+{
+    off_t size;
+
+    (void)replay;
+    if (handle->replay_from >= 0) {
+        /* The driver rejects offsets past its contents: clamp to the end */
+        size = chardev_size();
+        lseek(handle->fd, handle->replay_from < size ? handle->replay_from : size, SEEK_SET);
+    } else if (!handle->seeked) {
+        lseek(handle->fd, 0, SEEK_SET);
+    }
+}
+
+static ssize_t chardev_replay_read(struct store_handle *handle, struct store_replay *replay,
+                                   char *buf, size_t size)
+{
+    ssize_t n;
+
+    (void)replay;
+    do {
+        n = read(handle->fd, buf, size);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/* Device -> pipe -> socket; bytes parked in the pipe go out first */
+static ssize_t chardev_replay_send(struct store_handle *handle, struct store_replay *replay,
+                                   int sock_fd, size_t size)
+{
+    ssize_t n;
+
+    if (replay->piped == 0) {
+        if (replay->end >= 0 && (off_t)size > replay->end - replay->pos)
+            size = replay->end - replay->pos;
+        if (size == 0)
+            return 0;
+
+        if (replay->pipe_fd[0] == -1 && pipe2(replay->pipe_fd, O_CLOEXEC) != 0)
+            return -1;
+
+        n = splice(handle->fd, NULL, replay->pipe_fd[1], NULL, size, SPLICE_F_MOVE);
+        if (n <= 0)
+            return n;
+        replay->pos += n;
+        replay->piped = n;
+    }
+
+    n = splice(replay->pipe_fd[0], NULL, sock_fd, NULL, replay->piped,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n > 0)
+        replay->piped -= n;
+    return n;
+}
+
+const struct store_backend store_backend_chardev = {
+    .name = "chardev",
+    .path = AESDCHAR_PATH,
+    .device = 1,
+    .init = chardev_init,
+    .cleanup = chardev_cleanup,
+    .open = chardev_open,
+    .close = chardev_close,
+    .appendv = chardev_appendv,
+    .seekto = chardev_seekto,
+    .size = chardev_size,
+    .replay_begin = chardev_replay_begin,
+    .replay_read = chardev_replay_read,
+    .replay_send = chardev_replay_send,
+};
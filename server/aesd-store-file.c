@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Store backend: plain data file
+ *
+ *  - The original layout: packets appended to DATAFILE_PATH, truncated
+ *    at startup and removed at shutdown, unless a hot restart handed
+ *    the open file to the successor
+ *  - Appends are one writev; the committed length is published after it
+ *    returns, so replays read with pread up to a length that is fully
+ *    written, and share the descriptor without sharing an offset
+ *  - fdatasync is the sync hook behind --durability; nothing else syncs
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+static int file_fd = -1;
+static atomic_llong file_committed;
+static int file_handed_off;
+
+static int file_init(void)
+{
+    file_fd = open(DATAFILE_PATH, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (file_fd < 0) {
+        syslog(LOG_ERR, "open %s: %s", DATAFILE_PATH, strerror(errno));
+        return -1;
+    }
+    atomic_store(&file_committed, 0);
+    return 0;
+}
+
+static void file_cleanup(void)
+{
+    if (file_fd == -1)
+        return;
+    close(file_fd);
+    file_fd = -1;
+    if (!file_handed_off)
+        remove(DATAFILE_PATH);
+}
+
+static int file_handoff_export(int *fd, off_t *size)
+{
+    *fd = file_fd;
+    *size = atomic_load(&file_committed);
+    file_handed_off = 1;
+    return 0;
+}
+
+static int file_handoff_import(int fd, off_t size)
+{
+    file_fd = fd;
+    atomic_store(&file_committed, size);
+    return 0;
+}
+
+static int file_open(struct store_handle *handle)
+{
+    handle->fd = file_fd;
+    return 0;
+}
+
+static int file_appendv(const struct iovec *iov, int iovcnt)
+{
+    long long total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (store_writev_all(file_fd, iov, iovcnt) != 0) {
+        syslog(LOG_ERR, "write %s: %s", DATAFILE_PATH, strerror(errno));
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&file_committed, total, memory_order_release);
+    return 0;
+}
+
+static int file_sync(void)
+{
+    if (fdatasync(file_fd) != 0) {
+        syslog(LOG_ERR, "fdatasync %s: %s", DATAFILE_PATH, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static off_t file_size(void)
+{
+    return atomic_load_explicit(&file_committed, memory_order_acquire);
+}
+
+static ssize_t file_replay_read(struct store_handle *handle, struct store_replay *replay,
+                                char *buf, size_t size)
+{
+    ssize_t n;
+
+    do {
+        n = pread(handle->fd, buf, size, replay->pos);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static off_t file_offset(off_t pos)
+{
+    return pos;
+}
+
+const struct store_backend store_backend_file = {
+    .name = "file",
+    .path = DATAFILE_PATH,
+    .init = file_init,
+    .cleanup = file_cleanup,
+    .open = file_open,
+    .appendv = file_appendv,
+    .sync = file_sync,
+    .size = file_size,
+    .replay_read = file_replay_read,
+    .file_offset = file_offset,
+    .handoff_export = file_handoff_export,
+    .handoff_import = file_handoff_import,
+};
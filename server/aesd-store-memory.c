@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Store backend: process memory
+ *
+ *  - Nothing touches the file system and nothing survives a restart,
+ *    except a hot restart: the successor maps the same memory
+ *  - Packets go into one memfd mapping reserved up front with
+ *    MAP_NORESERVE, so pages are only committed as the store grows and
+ *    the data never moves: replays copy without a lock, up to the
+ *    committed length they started with
+ *  - No descriptor behind the data, so replays are always copied
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+/* Largest store we can hold */
+#if UINTPTR_MAX > 0xffffffffu
+#define MEMORY_STORE_RESERVE ((size_t)16 << 30)
+#else
+#define MEMORY_STORE_RESERVE ((size_t)512 << 20)
+#endif
+
+static int memory_fd = -1;
+static char *memory_base;
+static atomic_size_t memory_committed;
+
+static int memory_map(int fd, size_t committed)
+{
+    void *base = mmap(NULL, MEMORY_STORE_RESERVE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_NORESERVE, fd, 0);
+
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "memory store: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memory_fd = fd;
+    memory_base = base;
+    atomic_store(&memory_committed, committed);
+    return 0;
+}
+
+static int memory_init(void)
+{
+    /* Sparse: the size only reserves room, pages come with the data */
+    int fd = memfd_create("aesdsocket-store", MFD_CLOEXEC);
+
+    if (fd < 0 || ftruncate(fd, MEMORY_STORE_RESERVE) != 0) {
+        syslog(LOG_ERR, "memory store: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return memory_map(fd, 0);
+}
+
+static void memory_cleanup(void)
+{
+    if (!memory_base)
+        return;
+    munmap(memory_base, MEMORY_STORE_RESERVE);
+    close(memory_fd);
+    memory_base = NULL;
+    memory_fd = -1;
+}
+
+static int memory_handoff_export(int *fd, off_t *size)
+{
+    *fd = memory_fd;
+    *size = atomic_load(&memory_committed);
+    return 0;
+}
+
+static int memory_handoff_import(int fd, off_t size)
+{
+    return memory_map(fd, size);
+}
+
+static int memory_appendv(const struct iovec *iov, int iovcnt)
+{
+    size_t committed = atomic_load_explicit(&memory_committed, memory_order_relaxed);
+    size_t total = committed;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (total > MEMORY_STORE_RESERVE) {
+        syslog(LOG_ERR, "memory store full");
+        errno = EFBIG;
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(memory_base + committed, iov[i].iov_base, iov[i].iov_len);
+        committed += iov[i].iov_len;
+    }
+
+    /* Data first, then the length */
+    atomic_store_explicit(&memory_committed, committed, memory_order_release);
+    return 0;
+}
+
+static off_t memory_size(void)
+{
+    return atomic_load_explicit(&memory_committed, memory_order_acquire);
+}
+
+static ssize_t memory_replay_read(struct store_handle *handle, struct store_replay *replay,
+                                  char *buf, size_t size)
+{
+    (void)handle;
+    memcpy(buf, memory_base + replay->pos, size);
+    return size;
+}
+
+const struct store_backend store_backend_memory = {
+    .name = "memory",
+    .path = NULL,
+    .init = memory_init,
+    .cleanup = memory_cleanup,
+    .appendv = memory_appendv,
+    .size = memory_size,
+    .replay_read = memory_replay_read,
+    .handoff_export = memory_handoff_export,
+    .handoff_import = memory_handoff_import,
+};
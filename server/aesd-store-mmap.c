@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Store backend: memory-mapped log that survives process crashes
+ *
+ *  - Thin adapter over aesd-mmap-log.c: whatever a process crash left
+ *    committed is kept, a clean shutdown removes the file. A hot restart
+ *    keeps it too, and the successor recovers it the same way
+ *  - No sync hook: after a power loss the log may be garbage, and
+ *    --durability falls back to none here
+ *  - Replays copy straight from the mapping; zero-copy replays sendfile
+ *    from the same page cache, past the log header
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <string.h>
+
+/* --- POSIX / system headers --- */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+static struct mmap_log store_log = { .fd = -1 };
+static int mmap_handed_off;
+
+static int mmap_init(void)
+{
+    return mmap_log_open(&store_log, DATAFILE_PATH);
+}
+
+static void mmap_cleanup(void)
+{
+    if (store_log.fd == -1)
+        return;
+
+    /* A clean shutdown leaves nothing to recover */
+    mmap_log_close(&store_log);
+    if (!mmap_handed_off)
+        remove(DATAFILE_PATH);
+}
+
+/* Nothing to pass: the file on disk is the state */
+static int mmap_handoff_export(int *fd, off_t *size)
+{
+    *fd = -1;
+    *size = mmap_log_committed(&store_log);
+    mmap_handed_off = 1;
+    return 0;
+}
+
+/* Replays read the shared log, nothing per client */
+static int mmap_open(struct store_handle *handle)
+{
+    handle->fd = store_log.fd;
+    return 0;
+}
+
+static int mmap_appendv(const struct iovec *iov, int iovcnt)
+{
+    return mmap_log_appendv(&store_log, iov, iovcnt);
+}
+
+static off_t mmap_size(void)
+{
+    return mmap_log_committed(&store_log);
+}
+
+/* Committed bytes never change: copy straight from the mapping */
+static ssize_t mmap_replay_read(struct store_handle *handle, struct store_replay *replay,
+                                char *buf, size_t size)
+{
+    (void)handle;
+    memcpy(buf, mmap_log_data(&store_log) + replay->pos, size);
+    return size;
+}
+
+static off_t mmap_file_offset(off_t pos)
+{
+    return mmap_log_data_offset() + pos;
+}
+
+const struct store_backend store_backend_mmap = {
+    .name = "mmap",
+    .path = DATAFILE_PATH,
+    .init = mmap_init,
+    .cleanup = mmap_cleanup,
+    .open = mmap_open,
+    .appendv = mmap_appendv,
+    .size = mmap_size,
+    .replay_read = mmap_replay_read,
+    .file_offset = mmap_file_offset,
+    .handoff_export = mmap_handoff_export,
+};
@@ -0,0 +1,779 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Data store front end
+ *
+ *  - One backend is picked at startup (--backend): char device, plain
+ *    file, memory-mapped log or memory; see struct store_backend
+ *  - Appends are serialized by the write side of store_lock, and only for
+ *    the duration of the write itself; a batch of packets is one writev.
+ *    Time spent blocked on the lock goes to the metrics
+ *  - Backends that own their bytes publish a committed length, and
+ *    replays read up to the length they started with, without any lock.
+ *    On the char device the driver owns the data, so replays hold the
+ *    read side of store_lock to see a consistent set of entries
+ *  - A replay covers the whole store unless the client asked for a delta
+ *    (AESDREPLAY): from a byte offset, a write command or what was
+ *    appended since it connected
+ *  - Replays go straight from the store to the socket when the kernel
+ *    allows it: sendfile for file backends, the backend's own hook
+ *    otherwise. It is disabled for good the first time the backend
+ *    rejects it, and callers fall back to store_replay_read
+ *  - A client may ask for gzip compressed replays (AESDREPLAY:deflate);
+ *    those are always copied, through aesd-deflate.c
+ *  - Backends other than the char device are indexed by write command
+ *    (aesd-index.c): AESDCHAR_IOCSEEKTO works on them too, and seeks
+ *    and AESDREPLAY:since cost a lookup rather than a scan
+ *  - Committed appends also go to the subscribe ring (aesd-pubsub.c),
+ *    still under the write lock so subscribers see store order
+ *  - With --durability an append returns once it is on disk, so the
+ *    client's reply doubles as the acknowledgement: one fdatasync per
+ *    append, or a group commit where a leader waits up to --group-window
+ *    (or --group-bytes) and one fdatasync covers every append before it.
+ *    Event loop engines wait in place; concurrency comes from threads,
+ *    pool workers or several loops
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <endian.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static const struct store_backend *const store_backends[] = {
+    &store_backend_chardev,
+    &store_backend_file,
+    &store_backend_mmap,
+    &store_backend_memory,
+};
+
+static const struct store_backend *backend;
+
+/* Set once the backend rejected zero-copy */
+static atomic_int zero_copy_unsupported;
+
+/* Largest chunk moved by one zero-copy call */
+#define ZERO_COPY_CHUNK (64 * 1024)
+
+static ssize_t store_replay_copy(struct store_handle *handle, struct store_replay *replay,
+                                 char *buf, size_t size);
+
+/* Durability in effect: server_config.durability if the backend can sync */
+static enum store_durability durability;
+
+/* Group commit state, guarded by sync_lock */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond;
+static off_t sync_appended;     /* end of the appends waiting to be durable */
+static off_t sync_durable;      /* bytes known to be on disk */
+static int sync_leading;        /* an append is gathering others or syncing */
+static int sync_errno;          /* a failed sync: later ones prove nothing */
+
+/* Only a contended lock pays for the clock reads */
+static void store_wrlock(void)
+{
+    uint64_t start;
+
+    if (pthread_rwlock_trywrlock(&store_lock) == 0)
+        return;
+    start = metrics_now_ns();
+    pthread_rwlock_wrlock(&store_lock);
+    metrics_lock_wait(metrics_now_ns() - start);
+}
+
+static void store_rdlock(void)
+{
+    uint64_t start;
+
+    if (pthread_rwlock_tryrdlock(&store_lock) == 0)
+        return;
+    start = metrics_now_ns();
+    pthread_rwlock_rdlock(&store_lock);
+    metrics_lock_wait(metrics_now_ns() - start);
+}
+
+/* -------------------------------------------------------------------------
+ * Setup
+ * ----------------------------------------------------------------------*/
+
+const struct store_backend *store_backend_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(store_backends) / sizeof(store_backends[0]); i++) {
+        if (strcmp(store_backends[i]->name, name) == 0)
+            return store_backends[i];
+    }
+    return NULL;
+}
+
+/* --durability needs a sync hook; without one appends are acknowledged as before */
+static void store_durability_init(void)
+{
+    static const char *const names[] = { "none", "packet", "group" };
+    pthread_condattr_t attr;
+
+    durability = server_config.durability;
+    if (durability != DURABILITY_NONE && !backend->sync) {
+        syslog(LOG_WARNING, "store backend %s cannot sync, --durability %s ignored",
+               backend->name, names[durability]);
+        durability = DURABILITY_NONE;
+    }
+    if (durability == DURABILITY_NONE)
+        return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sync_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    sync_appended = sync_durable = backend->size();
+    sync_errno = 0;
+    syslog(LOG_INFO, "durability %s", names[durability]);
+}
+
+/* Index whatever the backend starts out with: a recovered log, a handed-off store */
+static int store_index_load(void)
+{
+    struct store_handle handle;
+    off_t size;
+    int rc;
+
+    store_durability_init();
+    if (backend->device)
+        return 0;
+    if (packet_index_init() != 0 || store_open(&handle) != 0)
+        goto fail;
+
+    size = backend->size();
+    rc = size > 0 ? packet_index_rebuild(&handle, store_replay_copy, size) : 0;
+    store_close(&handle);
+    if (rc == 0)
+        return 0;
+
+fail:
+    syslog(LOG_ERR, "store backend %s: cannot index packets", backend->name);
+    packet_index_cleanup();
+    backend->cleanup();
+    backend = NULL;
+    return -1;
+}
+
+int store_init(const char *name)
+{
+    backend = store_backend_find(name);
+    if (!backend) {
+        syslog(LOG_ERR, "unknown store backend %s", name);
+        return -1;
+    }
+
+    if (backend->init() != 0) {
+        backend = NULL;
+        return -1;
+    }
+
+    syslog(LOG_INFO, "store backend %s (%s)", backend->name,
+           backend->path ? backend->path : "no file");
+    return store_index_load();
+}
+
+/* Backends without handoff_export hand nothing over; the successor starts empty */
+int store_handoff_export(const char **backend_name, int *fd, off_t *size)
+{
+    if (!backend || !backend->handoff_export) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    *backend_name = backend->name;
+    return backend->handoff_export(fd, size);
+}
+
+/* An fd of -1 means the backend finds its state on its own: plain init */
+int store_init_handoff(const char *name, int fd, off_t size)
+{
+    if (fd < 0)
+        return store_init(name);
+
+    backend = store_backend_find(name);
+    if (!backend || !backend->handoff_import) {
+        syslog(LOG_ERR, "store backend %s cannot take over a handed-off store", name);
+        backend = NULL;
+        return -1;
+    }
+
+    if (backend->handoff_import(fd, size) != 0) {
+        backend = NULL;
+        return -1;
+    }
+
+    syslog(LOG_INFO, "store backend %s (%s), %lld bytes handed over", backend->name,
+           backend->path ? backend->path : "no file", (long long)size);
+    return store_index_load();
+}
+
+void store_cleanup(void)
+{
+    if (!backend)
+        return;
+    backend->cleanup();
+    backend = NULL;
+    packet_index_cleanup();
+    deflate_cache_cleanup();
+}
+
+int store_is_device(void)
+{
+    return backend && backend->device;
+}
+
+int store_open(struct store_handle *handle)
+{
+    handle->seeked = 0;
+    handle->fd = -1;
+    handle->replay_from = -1;
+    handle->deflate = 0;
+    handle->subscribe = 0;
+    handle->subscribe_from = -1;
+    handle->keepalive = 0;
+    handle->binary = 0;
+    handle->reply_body = NULL;
+    if (backend->open && backend->open(handle) != 0)
+        return -1;
+    handle->opened_size = backend->size();
+    return 0;
+}
+
+void store_close(struct store_handle *handle)
+{
+    if (backend->close)
+        backend->close(handle);
+    handle->fd = -1;
+    free(handle->reply_body);
+    handle->reply_body = NULL;
+}
+
+off_t store_size(void)
+{
+    return backend->size();
+}
+
+/* -------------------------------------------------------------------------
+ * Appends
+ * ----------------------------------------------------------------------*/
+
+int store_writev_all(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec pending[IOV_MAX];
+    int i;
+
+    if (iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Local copy: a short write advances it in place */
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, pending, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (i = 0; i < iovcnt && (size_t)n >= pending[i].iov_len; i++)
+            n -= pending[i].iov_len;
+        memmove(pending, pending + i, (iovcnt - i) * sizeof(struct iovec));
+        iovcnt -= i;
+        if (iovcnt > 0) {
+            pending[0].iov_base = (char *)pending[0].iov_base + n;
+            pending[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* ---- Durability ---- */
+
+/*
+ * Group commit leader, called with sync_lock held: wait for the window
+ * to gather appends, then sync everything appended so far
+ */
+static int store_sync_lead(void)
+{
+    struct timespec deadline;
+    uint64_t start;
+    off_t target;
+    int rc;
+
+    sync_leading = 1;
+    if (durability == DURABILITY_GROUP && server_config.group_commit_us > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long)(server_config.group_commit_us % 1000000) * 1000;
+        deadline.tv_sec += server_config.group_commit_us / 1000000 +
+                           deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while ((size_t)(sync_appended - sync_durable) < server_config.group_commit_bytes &&
+               pthread_cond_timedwait(&sync_cond, &sync_lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+
+    /* Every append counted here was written before the sync starts */
+    target = sync_appended;
+    pthread_mutex_unlock(&sync_lock);
+    start = metrics_now_ns();
+    rc = backend->sync();
+    metrics_store_synced(metrics_now_ns() - start);
+    pthread_mutex_lock(&sync_lock);
+
+    if (rc != 0)
+        sync_errno = errno ? errno : EIO;
+    else if (target > sync_durable)
+        sync_durable = target;
+    sync_leading = 0;
+    pthread_cond_broadcast(&sync_cond);
+    return rc;
+}
+
+/* Return once the first end bytes of the store are durable */
+static int store_sync(off_t end)
+{
+    int rc = 0;
+
+    if (durability == DURABILITY_PACKET) {
+        uint64_t start = metrics_now_ns();
+
+        rc = backend->sync();
+        metrics_store_synced(metrics_now_ns() - start);
+        return rc;
+    }
+
+    pthread_mutex_lock(&sync_lock);
+    if (end > sync_appended)
+        sync_appended = end;
+    while (!sync_errno && sync_durable < end) {
+        if (!sync_leading) {
+            store_sync_lead();
+            continue;
+        }
+        /* A full byte window ends the leader's wait early */
+        if ((size_t)(sync_appended - sync_durable) >= server_config.group_commit_bytes)
+            pthread_cond_broadcast(&sync_cond);
+        pthread_cond_wait(&sync_cond, &sync_lock);
+    }
+    if (sync_errno && sync_durable < end) {
+        errno = sync_errno;
+        rc = -1;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return rc;
+}
+
+int store_appendv(const struct iovec *iov, int iovcnt)
+{
+    off_t start, end;
+    int rc;
+
+    if (iovcnt <= 0)
+        return 0;
+
+    store_wrlock();
+    start = backend->device ? 0 : backend->size();
+    rc = backend->appendv(iov, iovcnt);
+    if (rc == 0 && !backend->device)
+        packet_index_append(start, iov, iovcnt);
+    if (rc == 0)
+        pubsub_publish(iov, iovcnt);
+    end = backend->size();
+    pthread_rwlock_unlock(&store_lock);
+
+    /* Only durable appends are acknowledged */
+    if (rc == 0 && durability != DURABILITY_NONE)
+        rc = store_sync(end);
+
+    if (rc == 0) {
+        metrics_packets_appended(iovcnt);
+        replication_notify();
+    }
+    return rc;
+}
+
+int store_append(const char *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return store_appendv(&iov, 1);
+}
+
+/*
+ * Start and length of write command write_cmd. When there is no such
+ * command, -1 with *start at the end of the last one.
+ */
+static int store_packet_locate(struct store_handle *handle, unsigned int write_cmd,
+                               off_t *start, off_t *len)
+{
+    struct store_replay scan;
+    char buf[BUFFER_SIZE * 4];
+    size_t skip;
+    ssize_t n;
+
+    if (packet_index_lookup(write_cmd, start, len) == 0)
+        return 0;
+
+    *start = packet_index_start(write_cmd);
+    if (!packet_index_full())
+        return -1;
+
+    /* Only packets past a full index are scanned for */
+    skip = write_cmd - packet_index_count();
+    memset(&scan, 0, sizeof(scan));
+    scan.start = scan.pos = *start;
+    scan.end = backend->size();
+    while (scan.pos < scan.end) {
+        char *p = buf, *nl;
+
+        n = store_replay_copy(handle, &scan, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        while ((nl = memchr(p, '\n', buf + n - p)) != NULL) {
+            off_t end = scan.pos - n + (nl + 1 - buf);
+
+            if (skip-- == 0) {
+                *len = end - *start;
+                return 0;
+            }
+            *start = end;
+            p = nl + 1;
+        }
+    }
+    return -1;
+}
+
+int store_seekto(struct store_handle *handle, unsigned int write_cmd,
+                 unsigned int write_cmd_offset)
+{
+    off_t start, len;
+    int rc;
+
+#ifdef DEBUG
+    fprintf(stderr, "seekto: %u %u\n", write_cmd, write_cmd_offset);
+#endif
+    if (backend->seekto) {
+        rc = backend->seekto(handle, write_cmd, write_cmd_offset);
+        if (rc < 0)
+            return -1;
+        /* 0 or -1 only: a raw driver result here would pass for a seek */
+        if (rc > 0) {
+            syslog(LOG_ERR, "store backend %s: seekto returned %d, expected 0 or -1",
+                   backend->name, rc);
+            errno = EINVAL;
+            return -1;
+        }
+    } else {
+        /* Same rules as the driver: an existing command, an offset inside it */
+        if (store_packet_locate(handle, write_cmd, &start, &len) != 0 ||
+            write_cmd_offset >= len) {
+            errno = EINVAL;
+            return -1;
+        }
+        handle->replay_from = start + write_cmd_offset;
+    }
+
+    handle->seeked = 1;
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Replays
+ * ----------------------------------------------------------------------*/
+
+int store_replay_from(struct store_handle *handle, off_t offset)
+{
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    handle->replay_from = offset;
+    return 0;
+}
+
+int store_replay_since(struct store_handle *handle, unsigned int write_cmd)
+{
+    off_t start, len;
+
+    /*
+     * The driver knows its entries: same as AESDCHAR_IOCSEEKTO:write_cmd,0.
+     * store_seekto() fails with EINVAL only for a command the driver does
+     * not hold; past the newest one that means nothing new yet, so replay
+     * from the end rather than everything. Other errors are real failures.
+     */
+    if (backend->device) {
+        if (store_seekto(handle, write_cmd, 0) == 0)
+            return 0;
+        if (errno != EINVAL)
+            return -1;
+        handle->replay_from = backend->size();
+        handle->seeked = 1;
+        return 0;
+    }
+
+    /* Past the last command: an empty replay, from the end */
+    store_packet_locate(handle, write_cmd, &start, &len);
+    return store_replay_from(handle, start);
+}
+
+void store_replay_new(struct store_handle *handle)
+{
+    handle->replay_from = handle->opened_size;
+}
+
+void store_replay_all(struct store_handle *handle)
+{
+    handle->replay_from = -1;
+    handle->seeked = 0;
+}
+
+void store_replay_deflate(struct store_handle *handle)
+{
+    handle->deflate = 1;
+}
+
+void store_replay_subscribe(struct store_handle *handle)
+{
+    handle->subscribe = 1;
+}
+
+void store_replay_keepalive(struct store_handle *handle)
+{
+    handle->keepalive = 1;
+}
+
+off_t store_replay_remaining(const struct store_replay *replay)
+{
+    if (replay->compressed || replay->end < 0)
+        return -1;
+    return replay->end - replay->pos;
+}
+
+void store_reply_binary(struct store_handle *handle, int op, int status,
+                        char *body, size_t len)
+{
+    free(handle->reply_body);
+    handle->reply_op = op;
+    handle->reply_status = status;
+    handle->reply_body = body;
+    handle->reply_len = len;
+}
+
+size_t store_reply_header(const struct store_handle *handle, char *buf, size_t size,
+                          off_t len)
+{
+    int n;
+
+    if (handle->binary) {
+        struct binary_header header = {
+            .opcode = handle->reply_op,
+            .status = handle->reply_status > 255 ? EIO : handle->reply_status,
+            .length = htobe32((uint32_t)len),
+        };
+
+        if (size < sizeof(header))
+            return 0;
+        memcpy(buf, &header, sizeof(header));
+        return sizeof(header);
+    }
+
+    n = snprintf(buf, size, REPLY_HEADER "%lld\n", (long long)len);
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size);
+}
+
+void store_replay_begin(struct store_handle *handle, struct store_replay *replay)
+{
+    replay->pos = 0;
+    replay->compressed = handle->deflate;
+    replay->deflate = NULL;
+    replay->pipe_fd[0] = replay->pipe_fd[1] = -1;
+    replay->piped = 0;
+    replay->locked = 0;
+    replay->end = -1;
+    replay->body = NULL;
+
+    /* Binary replies other than a REPLAY or SEEKTO that worked come from memory */
+    if (handle->binary && ((handle->reply_op != BINARY_OP_REPLAY &&
+                            handle->reply_op != BINARY_OP_SEEKTO) || handle->reply_status)) {
+        replay->compressed = 0;
+        replay->body = handle->reply_body;
+        replay->start = replay->pos = 0;
+        replay->end = handle->reply_len;
+        handle->reply_body = NULL;
+        return;
+    }
+
+    if (backend->device) {
+        store_rdlock();
+        replay->locked = 1;
+    } else {
+        replay->end = backend->size();
+        if (handle->replay_from >= 0)
+            replay->pos = handle->replay_from < replay->end ? handle->replay_from
+                                                            : replay->end;
+    }
+    replay->start = replay->pos;
+    handle->subscribe_from = replay->end;
+
+    /* A gzip stream has no length up front: this reply ends the connection */
+    if (handle->keepalive && handle->deflate) {
+        syslog(LOG_WARNING, "keep-alive does not combine with compressed replays");
+        handle->keepalive = 0;
+    }
+
+    if (backend->replay_begin)
+        backend->replay_begin(handle, replay);
+}
+
+static ssize_t store_replay_copy(struct store_handle *handle, struct store_replay *replay,
+                                 char *buf, size_t size)
+{
+    ssize_t n;
+
+    if (replay->end >= 0 && (off_t)size > replay->end - replay->pos)
+        size = replay->end - replay->pos;
+    if (size == 0)
+        return 0;
+
+    if (replay->body) {
+        memcpy(buf, replay->body + replay->pos, size);
+        replay->pos += size;
+        return size;
+    }
+
+    n = backend->replay_read(handle, replay, buf, size);
+    if (n > 0)
+        replay->pos += n;
+    return n;
+}
+
+ssize_t store_replay_read(struct store_handle *handle, struct store_replay *replay,
+                          char *buf, size_t size)
+{
+    /* Only append-only backends keep block offsets stable for the cache */
+    if (replay->compressed)
+        return deflate_replay_read(handle, replay, buf, size, !backend->device,
+                                   store_replay_copy);
+    return store_replay_copy(handle, replay, buf, size);
+}
+
+/* Remember that zero-copy is unavailable and report it to the caller */
+static ssize_t zero_copy_rejected(void)
+{
+    if (!atomic_exchange(&zero_copy_unsupported, 1))
+        syslog(LOG_INFO, "zero-copy replay not supported by the %s backend, copying",
+               backend->name);
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t store_replay_send(struct store_handle *handle, struct store_replay *replay,
+                          int sock_fd)
+{
+    size_t size = ZERO_COPY_CHUNK;
+    off_t file_pos;
+    ssize_t n;
+
+    if (replay->body) {
+        if ((off_t)size > replay->end - replay->pos)
+            size = replay->end - replay->pos;
+        if (size == 0)
+            return 0;
+        n = send(sock_fd, replay->body + replay->pos, size, MSG_NOSIGNAL);
+        if (n > 0)
+            replay->pos += n;
+        return n;
+    }
+
+    if (replay->compressed ||
+        atomic_load_explicit(&zero_copy_unsupported, memory_order_relaxed) ||
+        (!backend->file_offset && !backend->replay_send)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (backend->replay_send) {
+        n = backend->replay_send(handle, replay, sock_fd, size);
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            return zero_copy_rejected();
+        return n;
+    }
+
+    if ((off_t)size > replay->end - replay->pos)
+        size = replay->end - replay->pos;
+    if (size == 0)
+        return 0;
+
+    /* Page cache straight to the socket, without a user space copy */
+    file_pos = backend->file_offset(replay->pos);
+    n = sendfile(sock_fd, handle->fd, &file_pos, size);
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        return zero_copy_rejected();
+    if (n > 0)
+        replay->pos += n;
+    return n;
+}
+
+ssize_t store_replay_extent(struct store_handle *handle, struct store_replay *replay,
+                            size_t max, int *fd, off_t *offset)
+{
+    if (replay->compressed || replay->body || !backend->file_offset) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if ((off_t)max > replay->end - replay->pos)
+        max = replay->end - replay->pos;
+
+    *fd = handle->fd;
+    *offset = backend->file_offset(replay->pos);
+    replay->pos += max;
+    return max;
+}
+
+void store_replay_end(struct store_replay *replay)
+{
+    /* Any later read sees an ended, uncompressed replay and returns 0 */
+    deflate_replay_end(replay);
+    replay->compressed = 0;
+    free(replay->body);
+    replay->body = NULL;
+
+    if (replay->pipe_fd[0] != -1) {
+        close(replay->pipe_fd[0]);
+        close(replay->pipe_fd[1]);
+        replay->pipe_fd[0] = replay->pipe_fd[1] = -1;
+    }
+
+    if (replay->locked) {
+        pthread_rwlock_unlock(&store_lock);
+        replay->locked = 0;
+    }
+}
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * Periodic timestamps
+ *
+ *  - A background thread waits on a timerfd and appends a
+ *    "timestamp:" packet every TIMESTAMP_INTERVAL_S seconds through
+ *    store_append, the same locked path as client packets
+ *  - Nothing runs in signal context and no signal is raised, so client
+ *    I/O is never interrupted by the timer
+ *  - An eventfd wakes the thread for shutdown
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+static pthread_t timer_thread;
+static int timer_fd = -1;
+static int timer_stop_fd = -1;
+
+static void timestamp_append(void)
+{
+    time_t now;
+    struct tm tm_info;
+    char buf[128];
+    size_t len;
+
+    time(&now);
+    localtime_r(&now, &tm_info);
+
+    len = strftime(buf, sizeof(buf), "timestamp:%a, %d %b %Y %T %z\n", &tm_info);
+    if (len > 0 && store_append(buf, len) != 0)
+        syslog(LOG_ERR, "timestamp append failed");
+}
+
+static void* timestamp_timer_main(void* arg)
+{
+    struct pollfd fds[2];
+    uint64_t expirations;
+
+    (void)arg;
+    fds[0].fd = timer_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timer_stop_fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "timestamp timer: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        /* Ticks missed while the store was busy collapse into one */
+        if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            timestamp_append();
+    }
+    return NULL;
+}
+
+int timestamp_timer_start(void)
+{
+    struct itimerspec itval = {0};
+    sigset_t all_signals, old_mask;
+    int rc;
+
+    itval.it_value.tv_sec = TIMESTAMP_INTERVAL_S;
+    itval.it_interval.tv_sec = TIMESTAMP_INTERVAL_S;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    timer_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (timer_fd < 0 || timer_stop_fd < 0 ||
+        timerfd_settime(timer_fd, 0, &itval, NULL) != 0)
+        goto fail;
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    rc = pthread_create(&timer_thread, NULL, timestamp_timer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc != 0) {
+        errno = rc;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "timestamp timer: %s", strerror(errno));
+    if (timer_fd != -1)
+        close(timer_fd);
+    if (timer_stop_fd != -1)
+        close(timer_stop_fd);
+    timer_fd = timer_stop_fd = -1;
+    return -1;
+}
+
+void timestamp_timer_stop(void)
+{
+    uint64_t one = 1;
+
+    if (timer_stop_fd == -1)
+        return;
+
+    if (write(timer_stop_fd, &one, sizeof(one)) != sizeof(one))
+        syslog(LOG_ERR, "timestamp timer stop: %s", strerror(errno));
+    pthread_join(timer_thread, NULL);
+
+    close(timer_fd);
+    close(timer_stop_fd);
+    timer_fd = timer_stop_fd = -1;
+}
@@ -0,0 +1,1147 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * io_uring execution engine for aesdsocket
+ *
+ *  - Talks to the kernel through the raw io_uring syscalls, no liburing
+ *  - Multishot accept on every listener, TCP through the loop's shard;
+ *    multishot receives that pick their buffers from a ring of provided
+ *    buffers
+ *  - Log file replays are linked READ+SEND pairs, one chunk per pair;
+ *    char device snapshots are drained under the store lock and sent
+ *    from memory, as in the epoll engine
+ *  - Each SEND carries a linked timeout (--send-timeout) that cancels it
+ *    and drops a client that stopped reading
+ *  - Keep-alive connections keep their multishot receive through the
+ *    replies, buffering pipelined requests; a periodic TIMEOUT closes
+ *    those idle for --idle-timeout
+ *  - Startup probes the kernel and falls back to the epoll engine when
+ *    io_uring or one of the features above is missing
+ *  - After a hot restart the accepts are cancelled and open connections
+ *    get a HANDOFF_DRAIN_MS timer to finish before they are shut down
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <linux/io_uring.h>
+
+/* --- Project headers --- */
+#include "aesdsocket.h"
+
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 256         /* provided receive buffers, power of 2 */
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_REPLAY_CHUNK (64 * 1024)
+
+/* Low bits of user_data name the operation, the rest is a pointer */
+enum uring_op {
+    URING_OP_ACCEPT = 1,
+    URING_OP_WAKE,
+    URING_OP_CANCEL,
+    URING_OP_RECV,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_TIMEOUT,
+};
+#define URING_OP_MASK 7ULL
+
+/* Submission and completion rings shared with the kernel */
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sqe_tail;              /* prepared, not yet published */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+struct uring_conn {
+    int client_fd;
+    char client_ip[CLIENT_ADDR_LEN];
+    uint64_t request_ns;            /* latency clock, 0 between keep-alive requests */
+    struct admission_slot *admission;
+    struct store_handle store;
+    struct store_replay replay;
+    struct packet_framer framer;
+    int replaying;
+    int closing;
+    int recv_armed;
+    int inflight;                   /* operations the kernel still owns */
+    int keepalive;                  /* a keep-alive reply was sent */
+    int peer_closed;                /* keep-alive client sent EOF */
+    uint64_t active_ns;             /* last request byte or keep-alive reply */
+
+    char *tx_buf;                   /* READ target / SEND source */
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_cap;
+
+    struct uring_conn *prev;
+    struct uring_conn *next;
+};
+
+/* One multishot accept per listener; user_data points here */
+struct uring_acceptor {
+    struct uring_loop *loop;
+    int fd;
+    int armed;
+};
+
+struct uring_loop {
+    pthread_t thread;
+    struct uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+    unsigned short buf_tail;
+    int shard;                      /* listener shard, see aesd-shard.c */
+    struct uring_acceptor acceptors[MAX_LISTENERS];
+    int num_acceptors;
+    int accepts_armed;
+    int stopping;
+    int drain_expired;              /* hot restart drain timer fired */
+    struct uring_conn *conn_list_head;
+    struct obj_slab conn_slab;
+    struct __kernel_timespec send_timeout;  /* linked to every SEND */
+    struct __kernel_timespec drain_timeout;
+    struct __kernel_timespec idle_sweep;    /* WAKE owned by &idle_sweep */
+};
+
+static int shutdown_event_fd = -1;
+
+/* -------------------------------------------------------------------------
+ * Ring primitives
+ * ----------------------------------------------------------------------*/
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    size_t sq_size, cq_size;
+    char *ptr;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+        goto fail;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        goto fail;
+    }
+
+    ptr = ring->ring_ptr;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ptr + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+static void uring_destroy(struct uring *ring)
+{
+    if (ring->fd < 0)
+        return;
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+static unsigned uring_sq_space(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_entries - (ring->sqe_tail - head);
+}
+
+/* Publish prepared SQEs and optionally wait for completions */
+static int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    do {
+        rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+                                wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
+
+/* Make sure count SQEs can be prepared back to back (links must not split) */
+static int uring_reserve(struct uring *ring, unsigned count)
+{
+    if (uring_sq_space(ring) < count)
+        uring_submit(ring, 0);
+    return uring_sq_space(ring) >= count ? 0 : -1;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (uring_reserve(ring, 1) != 0)
+        return NULL;
+
+    idx = ring->sqe_tail & ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, int opcode, int fd, const void *addr,
+                       unsigned len, unsigned long long offset, void *owner,
+                       enum uring_op op)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (unsigned long long)(uintptr_t)owner | op;
+}
+
+/* -------------------------------------------------------------------------
+ * Provided receive buffers
+ * ----------------------------------------------------------------------*/
+
+static void uring_buffer_recycle(struct uring_loop *loop, unsigned short bid)
+{
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long long)(uintptr_t)(loop->buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_buffers_init(struct uring_loop *loop)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    unsigned short bid;
+
+    loop->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED) {
+        loop->buf_ring = NULL;
+        return -1;
+    }
+
+    loop->buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!loop->buf_base)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return -1;
+
+    loop->buf_tail = 0;
+    for (bid = 0; bid < URING_BUF_COUNT; bid++)
+        uring_buffer_recycle(loop, bid);
+    return 0;
+}
+
+static int uring_loop_init(struct uring_loop *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    slab_init(&loop->conn_slab, sizeof(struct uring_conn), 64);
+    loop->send_timeout.tv_sec = server_config.send_timeout_ms / 1000;
+    loop->send_timeout.tv_nsec = (server_config.send_timeout_ms % 1000) * 1000000LL;
+    loop->idle_sweep.tv_sec = server_config.idle_timeout_ms < 1000 ? 0 : 1;
+    loop->idle_sweep.tv_nsec = server_config.idle_timeout_ms < 1000 ?
+                               server_config.idle_timeout_ms * 1000000LL : 0;
+    if (uring_init(&loop->ring, URING_ENTRIES) != 0)
+        return -1;
+    return uring_buffers_init(loop);
+}
+
+static void uring_loop_destroy(struct uring_loop *loop)
+{
+    slab_destroy(&loop->conn_slab);
+    uring_destroy(&loop->ring);
+    if (loop->buf_ring)
+        munmap(loop->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(loop->buf_base);
+    loop->buf_ring = NULL;
+    loop->buf_base = NULL;
+}
+
+/* -------------------------------------------------------------------------
+ * Submissions
+ * ----------------------------------------------------------------------*/
+
+static int uring_arm_accept(struct uring_loop *loop, struct uring_acceptor *acceptor)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+    if (!sqe)
+        return -1;
+    uring_prep(sqe, IORING_OP_ACCEPT, acceptor->fd, NULL, 0, 0, acceptor, URING_OP_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    acceptor->armed = 1;
+    loop->accepts_armed++;
+    return 0;
+}
+
+/* Accept from every listener; TCP through this loop's shard */
+static int uring_arm_listeners(struct uring_loop *loop)
+{
+    int i;
+
+    loop->num_acceptors = listeners_count();
+    for (i = 0; i < loop->num_acceptors; i++) {
+        struct uring_acceptor *acceptor = &loop->acceptors[i];
+
+        acceptor->loop = loop;
+        acceptor->fd = listeners_fd(i);
+        if (acceptor->fd == server_socket_fd)
+            acceptor->fd = shard_listen_fd(loop->shard);
+        if (uring_arm_accept(loop, acceptor) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int uring_arm_wake(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+    if (!sqe)
+        return -1;
+    uring_prep(sqe, IORING_OP_POLL_ADD, shutdown_event_fd, NULL, 0, 0, loop, URING_OP_WAKE);
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+/* Completes as another WAKE once the drain time is up */
+static int uring_arm_drain_timer(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+    if (!sqe)
+        return -1;
+    loop->drain_timeout.tv_sec = HANDOFF_DRAIN_MS / 1000;
+    loop->drain_timeout.tv_nsec = (HANDOFF_DRAIN_MS % 1000) * 1000000L;
+    uring_prep(sqe, IORING_OP_TIMEOUT, -1, &loop->drain_timeout, 1, 0, loop, URING_OP_WAKE);
+    return 0;
+}
+
+/* Completes as a WAKE owned by &loop->idle_sweep, at least once a second */
+static int uring_arm_idle_sweep(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    if (server_config.idle_timeout_ms <= 0)
+        return 0;
+    sqe = uring_get_sqe(&loop->ring);
+    if (!sqe)
+        return -1;
+    uring_prep(sqe, IORING_OP_TIMEOUT, -1, &loop->idle_sweep, 1, 0, &loop->idle_sweep,
+               URING_OP_WAKE);
+    return 0;
+}
+
+static void uring_cancel_accepts(struct uring_loop *loop)
+{
+    int i;
+
+    for (i = 0; i < loop->num_acceptors; i++) {
+        struct io_uring_sqe *sqe;
+
+        if (!loop->acceptors[i].armed)
+            continue;
+        sqe = uring_get_sqe(&loop->ring);
+        if (!sqe)
+            return;
+        uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, loop, URING_OP_CANCEL);
+        sqe->addr = (unsigned long long)(uintptr_t)&loop->acceptors[i] | URING_OP_ACCEPT;
+    }
+}
+
+static int uring_arm_recv(struct uring_loop *loop, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+    if (!sqe)
+        return -1;
+    uring_prep(sqe, IORING_OP_RECV, conn->client_fd, NULL, 0, 0, conn, URING_OP_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    conn->recv_armed = 1;
+    conn->inflight++;
+    return 0;
+}
+
+/* With a send timeout the SEND is linked to a LINK_TIMEOUT that cancels it */
+static int uring_submit_send(struct uring_loop *loop, struct uring_conn *conn)
+{
+    int timed = server_config.send_timeout_ms > 0;
+    struct io_uring_sqe *sqe;
+
+    if (uring_reserve(&loop->ring, timed ? 2 : 1) != 0)
+        return -1;
+
+    sqe = uring_get_sqe(&loop->ring);
+    uring_prep(sqe, IORING_OP_SEND, conn->client_fd, conn->tx_buf + conn->tx_off,
+               conn->tx_len - conn->tx_off, 0, conn, URING_OP_SEND);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    conn->inflight++;
+
+    if (timed) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_get_sqe(&loop->ring);
+        uring_prep(sqe, IORING_OP_LINK_TIMEOUT, -1, &loop->send_timeout, 1, 0,
+                   conn, URING_OP_TIMEOUT);
+        conn->inflight++;
+    }
+    return 0;
+}
+
+/* READ a chunk of the store into tx_buf, SEND it once the read completes */
+static int uring_submit_read_send(struct uring_loop *loop, struct uring_conn *conn,
+                                  int fd, off_t offset, size_t len)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring_reserve(&loop->ring, server_config.send_timeout_ms > 0 ? 3 : 2) != 0)
+        return -1;
+
+    conn->tx_len = len;
+    conn->tx_off = 0;
+
+    sqe = uring_get_sqe(&loop->ring);
+    uring_prep(sqe, IORING_OP_READ, fd, conn->tx_buf, len, offset, conn, URING_OP_READ);
+    sqe->flags = IOSQE_IO_LINK;
+    conn->inflight++;
+
+    return uring_submit_send(loop, conn);
+}
+
+/* -------------------------------------------------------------------------
+ * Connections
+ * ----------------------------------------------------------------------*/
+
+/* Free the connection once the kernel holds no reference to it */
+static void uring_conn_release(struct uring_loop *loop, struct uring_conn *conn)
+{
+    if (!conn->closing || conn->inflight > 0)
+        return;
+
+    close(conn->client_fd);
+    syslog(LOG_INFO, "Closed connection from %s", conn->client_ip);
+
+    if (conn->replaying) {
+        store_replay_end(&conn->replay);
+        metrics_replay_done(conn->replay.pos - conn->replay.start);
+    }
+    store_close(&conn->store);
+    admission_release(conn->admission);
+    metrics_conn_closed(conn->request_ns);
+    framer_free(&conn->framer);
+    free(conn->tx_buf);
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conn_list_head = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    slab_free(&loop->conn_slab, conn);
+}
+
+/* Pending operations complete with an error once the socket is shut down */
+static void uring_conn_close(struct uring_loop *loop, struct uring_conn *conn)
+{
+    if (!conn->closing) {
+        conn->closing = 1;
+        shutdown(conn->client_fd, SHUT_RDWR);
+    }
+    uring_conn_release(loop, conn);
+}
+
+/*
+ * The socket lives on in aesd-pubsub.c: no shutdown, only the receive is
+ * cancelled, and the descriptor is closed once the kernel lets go of it
+ */
+static void uring_conn_hand_over(struct uring_loop *loop, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (conn->recv_armed) {
+        sqe = uring_get_sqe(&loop->ring);
+        if (!sqe) {
+            uring_conn_close(loop, conn);
+            return;
+        }
+        uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, loop, URING_OP_CANCEL);
+        sqe->addr = (unsigned long long)(uintptr_t)conn | URING_OP_RECV;
+    }
+    conn->closing = 1;
+    uring_conn_release(loop, conn);
+}
+
+static void uring_close_all(struct uring_loop *loop)
+{
+    struct uring_conn *conn = loop->conn_list_head;
+
+    while (conn) {
+        struct uring_conn *next = conn->next;
+        uring_conn_close(loop, conn);
+        conn = next;
+    }
+}
+
+static int uring_reserve_tx(struct uring_conn *conn, size_t size)
+{
+    if (conn->tx_cap < size) {
+        char *new_buf;
+
+        if (size > server_config.output_queue_max) {
+            syslog(LOG_WARNING, "Dropping %s: replay exceeds the %zu byte output queue",
+                   conn->client_ip, server_config.output_queue_max);
+            return -1;
+        }
+        new_buf = realloc(conn->tx_buf, size);
+        if (!new_buf)
+            return -1;
+        conn->tx_buf = new_buf;
+        conn->tx_cap = size;
+    }
+    return 0;
+}
+
+static void uring_conn_next(struct uring_loop *loop, struct uring_conn *conn);
+
+/* Keep-alive: the reply is out, the connection waits for its next request */
+static void uring_reply_done(struct uring_conn *conn)
+{
+    store_replay_end(&conn->replay);
+    metrics_replay_done(conn->replay.pos - conn->replay.start);
+    conn->replaying = 0;
+
+    metrics_request_done(conn->request_ns);
+    conn->request_ns = 0;
+    conn->active_ns = metrics_now_ns();
+    if (!conn->keepalive) {
+        conn->keepalive = 1;
+        client_keepalive_socket(conn->client_fd);
+    }
+}
+
+/* Queue the next piece of the replay, or close when it is complete */
+static void uring_replay_next(struct uring_loop *loop, struct uring_conn *conn)
+{
+    ssize_t n;
+    off_t offset;
+    int fd;
+
+    if (conn->tx_off < conn->tx_len) {
+        if (uring_submit_send(loop, conn) != 0)
+            uring_conn_close(loop, conn);
+        return;
+    }
+
+    if (uring_reserve_tx(conn, URING_REPLAY_CHUNK) != 0) {
+        uring_conn_close(loop, conn);
+        return;
+    }
+
+    n = store_replay_extent(&conn->store, &conn->replay, URING_REPLAY_CHUNK, &fd, &offset);
+    if (n > 0) {
+        if (uring_submit_read_send(loop, conn, fd, offset, n) != 0)
+            uring_conn_close(loop, conn);
+        return;
+    }
+
+    if (n < 0 && errno == EOPNOTSUPP) {
+        /* No file behind the store: copy the next chunk ourselves */
+        n = store_replay_read(&conn->store, &conn->replay, conn->tx_buf, conn->tx_cap);
+        if (n > 0) {
+            conn->tx_len = n;
+            conn->tx_off = 0;
+            if (uring_submit_send(loop, conn) != 0)
+                uring_conn_close(loop, conn);
+            return;
+        }
+    }
+
+    /* One request per connection unless keep-alive: close after the replay */
+    if (conn->store.subscribe) {
+        if (pubsub_subscribe(conn->client_fd, conn->client_ip, &conn->store) == 0)
+            uring_conn_hand_over(loop, conn);
+        else
+            uring_conn_close(loop, conn);
+    } else if (conn->store.keepalive) {
+        uring_reply_done(conn);
+        uring_conn_next(loop, conn);
+    } else {
+        uring_conn_close(loop, conn);
+    }
+}
+
+/*
+ * Snapshot the store; a locked snapshot is drained before returning.
+ * A keep-alive reply header goes first in tx_buf.
+ */
+static int uring_replay_begin(struct uring_conn *conn)
+{
+    char header[REPLY_HEADER_MAX];
+    size_t header_len;
+    int locked;
+
+    conn->replaying = 1;
+    conn->tx_len = conn->tx_off = 0;
+    if (!conn->request_ns)
+        conn->request_ns = metrics_now_ns();
+    store_replay_begin(&conn->store, &conn->replay);
+    locked = conn->replay.locked;
+
+    while (conn->replay.locked) {
+        ssize_t n;
+
+        if (uring_reserve_tx(conn, conn->tx_len + BUFFER_SIZE) != 0)
+            return -1;
+        n = store_replay_read(&conn->store, &conn->replay, conn->tx_buf + conn->tx_len,
+                              conn->tx_cap - conn->tx_len);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            conn->replay.end = conn->replay.pos;
+            store_replay_end(&conn->replay);
+            break;
+        }
+        conn->tx_len += n;
+        if (conn->tx_cap - conn->tx_len < BUFFER_SIZE &&
+            uring_reserve_tx(conn, conn->tx_cap * 2) != 0)
+            return -1;
+    }
+
+    if (!conn->store.keepalive)
+        return 0;
+    header_len = store_reply_header(&conn->store, header, sizeof(header),
+                                    locked ? (off_t)conn->tx_len
+                                           : store_replay_remaining(&conn->replay));
+    if (uring_reserve_tx(conn, conn->tx_len + header_len) != 0)
+        return -1;
+    memmove(conn->tx_buf + header_len, conn->tx_buf, conn->tx_len);
+    memcpy(conn->tx_buf, header, header_len);
+    conn->tx_len += header_len;
+    return 0;
+}
+
+/* Keep-alive: answer the next pipelined request, or wait for one */
+static void uring_conn_next(struct uring_loop *loop, struct uring_conn *conn)
+{
+    int rc = framer_next_request(&conn->framer, &conn->store);
+
+    if (rc < 0 || (rc == 0 && conn->peer_closed)) {
+        uring_conn_close(loop, conn);
+    } else if (rc == 0) {
+        if (!conn->recv_armed && uring_arm_recv(loop, conn) != 0)
+            uring_conn_close(loop, conn);
+    } else if (uring_replay_begin(conn) != 0) {
+        uring_conn_close(loop, conn);
+    } else {
+        uring_replay_next(loop, conn);
+    }
+}
+
+static void uring_handle_accept(struct uring_acceptor *acceptor, int res, unsigned flags)
+{
+    struct uring_loop *loop = acceptor->loop;
+    struct uring_conn *conn;
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        acceptor->armed = 0;
+        loop->accepts_armed--;
+    }
+
+    if (res >= 0) {
+        shard_count_accept(loop->shard);
+
+        /* Accepted before the cancel: still ours to serve while draining */
+        conn = loop->stopping && (!handoff_draining() || loop->drain_expired) ? NULL :
+               slab_alloc(&loop->conn_slab);
+        if (!conn) {
+            close(res);
+            goto rearm;
+        }
+
+        if (getpeername(res, (struct sockaddr*)&client_addr, &addr_len) == 0)
+            client_addr_format(res, &client_addr, conn->client_ip, sizeof(conn->client_ip));
+        if (admission_acquire(conn->client_ip, &conn->admission) != 0) {
+            slab_free(&loop->conn_slab, conn);
+            close(res);
+            goto rearm;
+        }
+        conn->framer.admission = conn->admission;
+        conn->client_fd = res;
+        conn->request_ns = metrics_now_ns();
+        metrics_conn_accepted();
+        syslog(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+
+        conn->next = loop->conn_list_head;
+        if (conn->next)
+            conn->next->prev = conn;
+        loop->conn_list_head = conn;
+
+        if (store_open(&conn->store) != 0 || uring_arm_recv(loop, conn) != 0)
+            uring_conn_close(loop, conn);
+    } else if (res != -ECANCELED) {
+        syslog(LOG_ERR, "accept: %s", strerror(-res));
+    }
+
+rearm:
+    if (!acceptor->armed && !loop->stopping)
+        uring_arm_accept(loop, acceptor);
+}
+
+static void uring_handle_recv(struct uring_loop *loop, struct uring_conn *conn,
+                              int res, unsigned flags)
+{
+    int packets = 0;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+        conn->inflight--;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = loop->buf_base + (size_t)bid * URING_BUF_SIZE;
+        size_t copied = 0;
+
+        /* Packets are only assembled until the replay starts, unless keep-alive */
+        while (res > 0 && !conn->closing && (!conn->replaying || conn->store.keepalive) &&
+               copied < (size_t)res) {
+            size_t room;
+            char *buf = framer_reserve(&conn->framer, &room);
+
+            if (!buf) {
+                packets = -1;
+                break;
+            }
+            if (room > res - copied)
+                room = res - copied;
+            memcpy(buf, data + copied, room);
+            framer_commit(&conn->framer, room);
+            copied += room;
+        }
+        uring_buffer_recycle(loop, bid);
+
+        if (copied > 0) {
+            conn->active_ns = metrics_now_ns();
+            if (!conn->request_ns)
+                conn->request_ns = conn->active_ns;
+        }
+        if (packets == 0 && copied > 0 && !conn->replaying)
+            packets = framer_process(&conn->framer, &conn->store);
+    }
+
+    if (conn->closing || (conn->replaying && !conn->store.keepalive)) {
+        uring_conn_release(loop, conn);
+        return;
+    }
+
+    if (res == -ENOBUFS) {
+        /* Out of provided buffers: they are back now, receive again */
+    } else if (res == 0 && conn->store.keepalive) {
+        /* Half-closed: the requests already buffered still get replies */
+        conn->peer_closed = 1;
+        if (conn->replaying)
+            uring_conn_release(loop, conn);
+        else
+            uring_conn_next(loop, conn);
+        return;
+    } else if (res <= 0 || packets < 0) {
+        uring_conn_close(loop, conn);
+        return;
+    } else if (conn->replaying) {
+        /* Pipelined requests wait for the reply; only so many of them */
+        if (conn->framer.len > server_config.output_queue_max) {
+            syslog(LOG_WARNING, "Dropping %s: pipelined requests exceed the %zu byte "
+                   "output queue", conn->client_ip, server_config.output_queue_max);
+            uring_conn_close(loop, conn);
+            return;
+        }
+    } else if (framer_request_done(&conn->framer, &conn->store, packets)) {
+        /* Keep-alive: armed before the replay, which may release conn */
+        if (conn->store.keepalive && !conn->recv_armed && uring_arm_recv(loop, conn) != 0) {
+            uring_conn_close(loop, conn);
+            return;
+        }
+        if (uring_replay_begin(conn) != 0)
+            uring_conn_close(loop, conn);
+        else
+            uring_replay_next(loop, conn);
+        return;
+    }
+
+    if (!conn->recv_armed && uring_arm_recv(loop, conn) != 0)
+        uring_conn_close(loop, conn);
+}
+
+static void uring_handle_read(struct uring_loop *loop, struct uring_conn *conn, int res)
+{
+    conn->inflight--;
+
+    /* A failed or short read leaves the linked SEND with bad data */
+    if (res < 0 || (size_t)res != conn->tx_len)
+        uring_conn_close(loop, conn);
+    else
+        uring_conn_release(loop, conn);
+}
+
+static void uring_handle_send(struct uring_loop *loop, struct uring_conn *conn, int res)
+{
+    conn->inflight--;
+
+    if (conn->closing || res <= 0) {
+        uring_conn_close(loop, conn);
+        return;
+    }
+
+    conn->tx_off += res;
+    if (conn->tx_off == conn->tx_len)
+        conn->tx_off = conn->tx_len = 0;
+    uring_replay_next(loop, conn);
+}
+
+/* -ETIME: the linked SEND made no progress in time and is being cancelled */
+static void uring_handle_timeout(struct uring_loop *loop, struct uring_conn *conn, int res)
+{
+    conn->inflight--;
+
+    if (res == -ETIME && !conn->closing) {
+        client_evict_slow(conn->client_ip);
+        uring_conn_close(loop, conn);
+    } else {
+        uring_conn_release(loop, conn);
+    }
+}
+
+/* Close keep-alive connections that sent nothing for idle_timeout_ms */
+static void uring_sweep_idle(struct uring_loop *loop)
+{
+    uint64_t now = metrics_now_ns();
+    uint64_t idle_ns = (uint64_t)server_config.idle_timeout_ms * 1000000u;
+    struct uring_conn *conn = loop->conn_list_head;
+
+    while (conn) {
+        struct uring_conn *next = conn->next;
+
+        if (conn->keepalive && !conn->replaying && !conn->closing &&
+            now - conn->active_ns > idle_ns) {
+            client_close_idle(conn->client_ip);
+            uring_conn_close(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+static void uring_handle_cqe(struct uring_loop *loop, unsigned long long user_data,
+                             int res, unsigned flags)
+{
+    enum uring_op op = user_data & URING_OP_MASK;
+    void *owner = (void *)(uintptr_t)(user_data & ~URING_OP_MASK);
+
+    switch (op) {
+    case URING_OP_ACCEPT:
+        uring_handle_accept(owner, res, flags);
+        break;
+    case URING_OP_WAKE:
+        if (owner == &loop->idle_sweep) {
+            uring_sweep_idle(loop);
+            if (!loop->stopping && uring_arm_idle_sweep(loop) != 0)
+                syslog(LOG_ERR, "io_uring: cannot arm the idle sweep");
+            break;
+        }
+        /* The second one is the hot restart drain timer */
+        if (loop->stopping) {
+            loop->drain_expired = 1;
+            uring_close_all(loop);
+        }
+        loop->stopping = 1;
+        break;
+    case URING_OP_CANCEL:
+        break;
+    case URING_OP_RECV:
+        uring_handle_recv(loop, owner, res, flags);
+        break;
+    case URING_OP_READ:
+        uring_handle_read(loop, owner, res);
+        break;
+    case URING_OP_SEND:
+        uring_handle_send(loop, owner, res);
+        break;
+    case URING_OP_TIMEOUT:
+        uring_handle_timeout(loop, owner, res);
+        break;
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Loop threads
+ * ----------------------------------------------------------------------*/
+
+static void uring_reap(struct uring_loop *loop)
+{
+    struct uring *ring = &loop->ring;
+    unsigned head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        unsigned long long user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        /* Hand the slot back first: handlers may wait for more */
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        uring_handle_cqe(loop, user_data, res, flags);
+    }
+}
+
+static void* uring_loop_main(void* arg)
+{
+    struct uring_loop *loop = arg;
+    int draining = 0;
+
+    shard_pin_thread(loop->shard);
+
+    if (uring_arm_listeners(loop) != 0 || uring_arm_wake(loop) != 0 ||
+        uring_arm_idle_sweep(loop) != 0) {
+        syslog(LOG_ERR, "io_uring: cannot arm listener");
+        return NULL;
+    }
+
+    while (!loop->stopping || loop->conn_list_head || loop->accepts_armed) {
+        if (loop->stopping && !draining) {
+            draining = 1;
+            uring_cancel_accepts(loop);
+            /* Hot restart: the successor accepts, ours may finish first */
+            if (!handoff_draining() || uring_arm_drain_timer(loop) != 0)
+                uring_close_all(loop);
+            continue;
+        }
+
+        if (uring_submit(&loop->ring, 1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        uring_reap(loop);
+    }
+
+    return NULL;
+}
+
+/*
+ * Check the kernel for everything the engine relies on: ring setup,
+ * provided buffer rings and multishot receive, the most recent of them.
+ */
+static int uring_probe(void)
+{
+    struct uring_loop probe;
+    int sv[2] = { -1, -1 };
+    struct io_uring_sqe *sqe;
+    int ok = 0;
+
+    if (uring_loop_init(&probe) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        goto done;
+
+    sqe = uring_get_sqe(&probe.ring);
+    uring_prep(sqe, IORING_OP_RECV, sv[0], NULL, 0, 0, NULL, URING_OP_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+
+    if (write(sv[1], "x", 1) == 1 && uring_submit(&probe.ring, 1) >= 0) {
+        unsigned head = *probe.ring.cq_head;
+
+        if (head != __atomic_load_n(probe.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &probe.ring.cqes[head & probe.ring.cq_mask];
+            ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) &&
+                 (cqe->flags & IORING_CQE_F_MORE);
+        }
+    }
+
+done:
+    if (!ok && errno == 0)
+        errno = EOPNOTSUPP;
+    if (sv[0] != -1) {
+        close(sv[0]);
+        close(sv[1]);
+    }
+    uring_loop_destroy(&probe);
+    return ok ? 0 : -1;
+}
+
+int uring_server_run(void)
+{
+    struct uring_loop *loops;
+    sigset_t all_signals, old_mask;
+    int num_loops = server_config.num_loops;
+    int started = 0;
+    int i;
+
+    errno = 0;
+    if (uring_probe() != 0) {
+        syslog(LOG_WARNING, "io_uring unavailable (%s), using epoll", strerror(errno));
+        return epoll_server_run();
+    }
+
+    if (num_loops <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_loops = cpus > 0 ? (int)cpus : 1;
+    }
+
+    shutdown_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    loops = calloc(num_loops, sizeof(struct uring_loop));
+    if (shutdown_event_fd < 0 || !loops || shards_init(num_loops) != 0) {
+        syslog(LOG_ERR, "io_uring engine: %s", strerror(errno));
+        free(loops);
+        if (shutdown_event_fd != -1)
+            close(shutdown_event_fd);
+        return -1;
+    }
+
+    /* Loop threads inherit a fully blocked mask: signals go to main */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+
+    for (i = 0; i < num_loops; i++) {
+        if (uring_loop_init(&loops[i]) != 0) {
+            uring_loop_destroy(&loops[i]);
+            break;
+        }
+        loops[i].shard = i;
+        if (pthread_create(&loops[i].thread, NULL, uring_loop_main, &loops[i]) != 0) {
+            uring_loop_destroy(&loops[i]);
+            break;
+        }
+        started++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (started == num_loops) {
+        syslog(LOG_INFO, "io_uring engine running %d ring(s)", num_loops);
+        wait_for_exit_signal(shards_log_stats);
+    } else {
+        syslog(LOG_ERR, "io_uring engine: started %d of %d rings", started, num_loops);
+    }
+
+    eventfd_write(shutdown_event_fd, 1);
+    for (i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+        uring_loop_destroy(&loops[i]);
+    }
+
+    shards_log_stats();
+    shards_cleanup();
+    close(shutdown_event_fd);
+    shutdown_event_fd = -1;
+    free(loops);
+
+    return started == num_loops ? 0 : -1;
+}
+
+#else /* no io_uring support in the kernel headers */
+
+int uring_server_run(void)
+{
+    syslog(LOG_WARNING, "io_uring not supported by this build, using epoll");
+    return epoll_server_run();
+}
+
+#endif
@@ -0,0 +1,720 @@
+#define _GNU_SOURCE
+
+/* ---------------------------------------------------------------------------
+ * aesdbench: load generator and latency benchmark for aesdsocket
+ *
+ *  - M client threads, each running connect / send one packet / read the
+ *    replay until the server closes, for a request count or a duration,
+ *    over TCP or the server's AF_UNIX socket (-U)
+ *  - Packet size and per-client rate are configurable; with a rate the
+ *    latency clock starts at the scheduled send time, so a stalled
+ *    server is not hidden by the clients slowing down with it
+ *  - A share of the requests can be AESDCHAR_IOCSEEKTO commands, and
+ *    data requests can ask for a delta replay (AESDREPLAY:new) and for
+ *    a gzip compressed one (AESDREPLAY:deflate), inflated before checking
+ *  - Replays are checked: they must end with a newline and contain the
+ *    packet just sent (seek replays only need to be newline terminated)
+ *  - With the server's stats socket (-S) the report also holds the store
+ *    syncs the run cost, to compare --durability modes on equal load
+ *  - One JSON object on stdout (or a text summary) so runs can be
+ *    compared between builds
+ * -------------------------------------------------------------------------*/
+
+/* --- Standard C headers --- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+/* --- POSIX / system headers --- */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <zlib.h>
+
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:0,0\n"
+#define DELTA_COMMAND "AESDREPLAY:new\n"
+#define DEFLATE_COMMAND "AESDREPLAY:deflate\n"
+#define RECV_CHUNK (64 * 1024)
+
+/* -------------------------------------------------------------------------
+ * Configuration and per-client results
+ * ----------------------------------------------------------------------*/
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    const char *unix_path;      /* connect here instead of host:port */
+    int connections;
+    long requests;              /* per client, ignored with duration */
+    double duration;            /* seconds, 0 = use requests */
+    size_t packet_size;         /* including the newline */
+    double rate;                /* requests/s per client, 0 = closed loop */
+    int seek_percent;
+    int delta;                  /* ask for AESDREPLAY:new instead of a full replay */
+    int deflate;                /* ask for compressed replays */
+    int verify;
+    int json;
+    const char *label;
+    const char *stats_path;     /* server stats socket, NULL = not read */
+};
+
+/* Server counters read before and after the run */
+struct server_stats {
+    uint64_t packets;
+    uint64_t syncs;
+};
+
+struct bench_client {
+    pthread_t thread;
+    int id;
+    uint64_t *latencies;        /* ns, one per completed request */
+    size_t count;
+    size_t cap;
+    uint64_t errors;            /* connect/send/recv failures */
+    uint64_t verify_failures;
+    uint64_t seeks;
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+};
+
+static struct bench_config config = {
+    .host = "127.0.0.1",
+    .port = "9000",
+    .unix_path = NULL,
+    .connections = 8,
+    .requests = 100,
+    .duration = 0,
+    .packet_size = 64,
+    .rate = 0,
+    .seek_percent = 0,
+    .delta = 0,
+    .deflate = 0,
+    .verify = 1,
+    .json = 1,
+    .label = "",
+    .stats_path = NULL,
+};
+
+static struct addrinfo *server_addr;
+static struct addrinfo unix_addrinfo;
+static struct sockaddr_un unix_addr;
+static uint64_t bench_start_ns;
+
+/* -------------------------------------------------------------------------
+ * Helpers
+ * ----------------------------------------------------------------------*/
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / 1000000000u;
+    ts.tv_nsec = deadline_ns % 1000000000u;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* The counters this report uses, from the server's stats socket */
+static int read_server_stats(struct server_stats *stats)
+{
+    struct sockaddr_un addr;
+    char report[8192];
+    size_t len = 0;
+    const char *line, *next;
+    int fd;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config.stats_path, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(config.stats_path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    while (len < sizeof(report) - 1) {
+        ssize_t n = recv(fd, report + len, sizeof(report) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+    report[len] = '\0';
+
+    for (line = report; line; line = next) {
+        unsigned long long value;
+
+        next = strchr(line, '\n');
+        if (next)
+            next++;
+        if (sscanf(line, "packets_appended %llu", &value) == 1)
+            stats->packets = value;
+        else if (sscanf(line, "store_syncs %llu", &value) == 1)
+            stats->syncs = value;
+    }
+    return 0;
+}
+
+static int record_latency(struct bench_client *client, uint64_t ns)
+{
+    if (client->count == client->cap) {
+        size_t new_cap = client->cap ? client->cap * 2 : 1024;
+        uint64_t *grown = realloc(client->latencies, new_cap * sizeof(uint64_t));
+        if (!grown)
+            return -1;
+        client->latencies = grown;
+        client->cap = new_cap;
+    }
+    client->latencies[client->count++] = ns;
+    return 0;
+}
+
+/* "c<id>-<seq>-xxx...\n", packet_size bytes, unique per request */
+static size_t build_packet(char *buf, size_t size, int id, long seq)
+{
+    int n = snprintf(buf, size, "c%d-%ld-", id, seq);
+
+    if (n < 0 || (size_t)n >= size)
+        n = 0;
+    memset(buf + n, 'x', size - n - 1);
+    buf[size - 1] = '\n';
+    return size;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Client threads
+ * ----------------------------------------------------------------------*/
+
+/*
+ * One request: returns the replay length, -1 on a transport error.
+ * With verification the whole replay is kept in *reply, otherwise the
+ * buffer is only a sink of RECV_CHUNK bytes.
+ */
+static ssize_t bench_request(const char *packet, size_t len, char **reply, size_t *reply_cap)
+{
+    size_t received = 0;
+    int one = 1;
+    int fd;
+
+    fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (server_addr->ai_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) != 0 ||
+        send_all(fd, packet, len) != 0)
+        goto fail;
+
+    while (1) {
+        size_t off = config.verify ? received : 0;
+        ssize_t n;
+
+        if (*reply_cap - off < RECV_CHUNK) {
+            size_t new_cap = *reply_cap ? *reply_cap * 2 : 2 * RECV_CHUNK;
+            char *grown = realloc(*reply, new_cap);
+
+            if (!grown)
+                goto fail;
+            *reply = grown;
+            *reply_cap = new_cap;
+        }
+
+        n = recv(fd, *reply + off, *reply_cap - off, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            goto fail;
+        if (n == 0)
+            break;
+        received += n;
+    }
+
+    close(fd);
+    return received;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* Concatenated gzip members back to the replay text; -1 if malformed */
+static ssize_t inflate_reply(const char *in, size_t in_len, char **out, size_t *out_cap)
+{
+    z_stream zs;
+    size_t len = 0;
+    int rc = Z_STREAM_END;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return -1;
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = in_len;
+
+    while (zs.avail_in > 0) {
+        if (rc == Z_STREAM_END)
+            inflateReset(&zs);
+        if (*out_cap - len < RECV_CHUNK) {
+            size_t new_cap = *out_cap ? *out_cap * 2 : 2 * RECV_CHUNK;
+            char *grown = realloc(*out, new_cap);
+
+            if (!grown) {
+                rc = Z_MEM_ERROR;
+                break;
+            }
+            *out = grown;
+            *out_cap = new_cap;
+        }
+        zs.next_out = (unsigned char *)*out + len;
+        zs.avail_out = *out_cap - len;
+        rc = inflate(&zs, Z_NO_FLUSH);
+        len = (char *)zs.next_out - *out;
+        if (rc != Z_OK && rc != Z_STREAM_END)
+            break;
+    }
+
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END ? (ssize_t)len : -1;
+}
+
+/* The replay must be whole packets and, for data, hold the one just sent */
+static int replay_is_valid(const char *reply, size_t len, const char *packet,
+                           size_t packet_len, int seek)
+{
+    if (len == 0)
+        return seek;
+    if (reply[len - 1] != '\n')
+        return 0;
+    return seek || memmem(reply, len, packet, packet_len) != NULL;
+}
+
+static void* bench_client_main(void* arg)
+{
+    struct bench_client *client = arg;
+    uint64_t interval = config.rate > 0 ? (uint64_t)(1e9 / config.rate) : 0;
+    uint64_t end_ns = config.duration > 0 ?
+                      bench_start_ns + (uint64_t)(config.duration * 1e9) : 0;
+    uint64_t next_ns = bench_start_ns;
+    unsigned int seed = client->id * 7919u + 1;
+    size_t delta_len = config.delta ? strlen(DELTA_COMMAND) : 0;
+    size_t deflate_len = config.deflate ? strlen(DEFLATE_COMMAND) : 0;
+    char *packet = malloc(deflate_len + config.packet_size + delta_len);
+    char *data = packet + deflate_len;
+    char *reply = NULL, *text = NULL;
+    size_t reply_cap = 0, text_cap = 0;
+    long seq;
+
+    if (!packet) {
+        client->errors++;
+        return NULL;
+    }
+    memcpy(packet, DEFLATE_COMMAND, deflate_len);
+
+    for (seq = 0; end_ns ? now_ns() < end_ns : seq < config.requests; seq++) {
+        int seek = config.seek_percent > 0 && (int)(rand_r(&seed) % 100) < config.seek_percent;
+        const char *out = seek ? SEEKTO_COMMAND : packet;
+        size_t out_len = seek ? strlen(SEEKTO_COMMAND) :
+                                deflate_len + config.packet_size + delta_len;
+        const char *replay;
+        uint64_t start, done;
+        ssize_t n;
+
+        if (!seek) {
+            build_packet(data, config.packet_size, client->id, seq);
+            memcpy(data + config.packet_size, DELTA_COMMAND, delta_len);
+        }
+
+        /* Open loop: latency counts from the slot, not the actual send */
+        if (interval) {
+            if (end_ns && next_ns >= end_ns)
+                break;
+            sleep_until(next_ns);
+            start = next_ns;
+            next_ns += interval;
+        } else {
+            start = now_ns();
+        }
+
+        n = bench_request(out, out_len, &reply, &reply_cap);
+        if (n < 0) {
+            client->errors++;
+            continue;
+        }
+        done = now_ns();
+
+        client->tx_bytes += out_len;
+        client->rx_bytes += n;
+        client->seeks += seek;
+        if (config.verify) {
+            /* Seek requests carry no AESDREPLAY:deflate and come back plain */
+            replay = reply;
+            if (config.deflate && !seek) {
+                n = inflate_reply(reply, n, &text, &text_cap);
+                replay = text;
+            }
+            if (n < 0 || !replay_is_valid(replay, n, seek ? out : data,
+                                          seek ? out_len : config.packet_size, seek))
+                client->verify_failures++;
+        }
+        if (record_latency(client, done - start) != 0)
+            client->errors++;
+    }
+
+    free(text);
+    free(reply);
+    free(packet);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------
+ * Report
+ * ----------------------------------------------------------------------*/
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted values, in microseconds */
+static double percentile_us(const uint64_t *sorted, size_t count, double q)
+{
+    size_t rank;
+
+    if (count == 0)
+        return 0;
+    rank = (size_t)(q * count + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return sorted[rank - 1] / 1000.0;
+}
+
+/* server: counter deltas over the run, NULL without --stats-socket */
+static void print_report(struct bench_client *clients, double elapsed,
+                         const struct server_stats *server)
+{
+    uint64_t *all;
+    uint64_t errors = 0, verify_failures = 0, seeks = 0, tx = 0, rx = 0;
+    double sum = 0;
+    size_t total = 0, off = 0;
+    int i;
+
+    for (i = 0; i < config.connections; i++)
+        total += clients[i].count;
+
+    all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!all) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < config.connections; i++) {
+        memcpy(all + off, clients[i].latencies, clients[i].count * sizeof(uint64_t));
+        off += clients[i].count;
+        errors += clients[i].errors;
+        verify_failures += clients[i].verify_failures;
+        seeks += clients[i].seeks;
+        tx += clients[i].tx_bytes;
+        rx += clients[i].rx_bytes;
+    }
+    for (off = 0; off < total; off++)
+        sum += all[off];
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    if (config.json) {
+        printf("{\"tool\":\"aesdbench\",\"label\":\"%s\",\"host\":\"%s\",\"port\":\"%s\","
+               "\"connections\":%d,\"packet_size\":%zu,\"rate_per_client\":%.1f,"
+               "\"seek_percent\":%d,\"delta\":%s,\"deflate\":%s,\"duration_s\":%.3f,\"requests\":%zu,\"seeks\":%llu,"
+               "\"errors\":%llu,\"verify_failures\":%llu,\"requests_per_s\":%.1f,"
+               "\"tx_bytes\":%llu,\"rx_bytes\":%llu,\"rx_mib_per_s\":%.3f,"
+               "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+               "\"p999\":%.1f,\"max\":%.1f}",
+               config.label, config.unix_path ? "unix" : config.host,
+               config.unix_path ? config.unix_path : config.port, config.connections,
+               config.packet_size, config.rate, config.seek_percent,
+               config.delta ? "true" : "false", config.deflate ? "true" : "false",
+               elapsed, total,
+               (unsigned long long)seeks, (unsigned long long)errors,
+               (unsigned long long)verify_failures, total / elapsed,
+               (unsigned long long)tx, (unsigned long long)rx, rx / elapsed / (1 << 20),
+               total ? sum / total / 1000.0 : 0.0,
+               percentile_us(all, total, 0.50), percentile_us(all, total, 0.90),
+               percentile_us(all, total, 0.99), percentile_us(all, total, 0.999),
+               total ? all[total - 1] / 1000.0 : 0.0);
+        if (server)
+            printf(",\"server\":{\"packets_appended\":%llu,\"store_syncs\":%llu,"
+                   "\"packets_per_sync\":%.1f}",
+                   (unsigned long long)server->packets, (unsigned long long)server->syncs,
+                   server->syncs ? (double)server->packets / server->syncs : 0.0);
+        printf("}\n");
+    } else {
+        printf("requests     %zu in %.3f s (%.1f req/s), %llu seeks\n",
+               total, elapsed, total / elapsed, (unsigned long long)seeks);
+        printf("errors       %llu transport, %llu verify\n",
+               (unsigned long long)errors, (unsigned long long)verify_failures);
+        printf("traffic      %llu B out, %llu B in (%.3f MiB/s in)\n",
+               (unsigned long long)tx, (unsigned long long)rx, rx / elapsed / (1 << 20));
+        printf("latency us   mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+               total ? sum / total / 1000.0 : 0.0,
+               percentile_us(all, total, 0.50), percentile_us(all, total, 0.90),
+               percentile_us(all, total, 0.99), percentile_us(all, total, 0.999),
+               total ? all[total - 1] / 1000.0 : 0.0);
+        if (server)
+            printf("server       %llu packets appended, %llu store syncs (%.1f packets/sync)\n",
+                   (unsigned long long)server->packets, (unsigned long long)server->syncs,
+                   server->syncs ? (double)server->packets / server->syncs : 0.0);
+    }
+
+    free(all);
+}
+
+/* -------------------------------------------------------------------------
+ * Command line
+ * ----------------------------------------------------------------------*/
+
+static void print_usage(const char *prog, int status)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port | -U path] [-c clients] [-n requests | -t seconds]\n"
+            "          [-s size] [-r rate] [-k percent] [-D] [-z] [-N] [-f json|text]\n"
+            "          [-L label] [-S path]\n"
+            "  -H, --host HOST       server address (default 127.0.0.1)\n"
+            "  -p, --port PORT       server port (default 9000)\n"
+            "  -U, --unix PATH       connect to the AF_UNIX socket PATH instead\n"
+            "  -c, --clients M       concurrent clients (default 8)\n"
+            "  -n, --requests N      requests per client (default 100)\n"
+            "  -t, --duration S      run for S seconds instead of a request count\n"
+            "  -s, --size BYTES      packet size including the newline (default 64)\n"
+            "  -r, --rate R          requests per second per client, 0 = as fast as\n"
+            "                        replies come back (default 0)\n"
+            "  -k, --seek-percent P  send AESDCHAR_IOCSEEKTO:0,0 for P%% of requests\n"
+            "  -D, --delta           ask for the delta since connecting (AESDREPLAY:new)\n"
+            "                        instead of the whole store\n"
+            "  -z, --deflate         ask for gzip compressed replays (AESDREPLAY:deflate)\n"
+            "  -N, --no-verify       do not check replays\n"
+            "  -f, --format FMT      json (default, one line) or text\n"
+            "  -L, --label TEXT      copied into the JSON output\n"
+            "  -S, --stats-socket P  read the server's stats socket P before and\n"
+            "                        after the run and report its store syncs\n",
+            prog);
+    exit(status);
+}
+
+static void parse_command_line(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "host",         required_argument, NULL, 'H' },
+        { "port",         required_argument, NULL, 'p' },
+        { "unix",         required_argument, NULL, 'U' },
+        { "clients",      required_argument, NULL, 'c' },
+        { "requests",     required_argument, NULL, 'n' },
+        { "duration",     required_argument, NULL, 't' },
+        { "size",         required_argument, NULL, 's' },
+        { "rate",         required_argument, NULL, 'r' },
+        { "seek-percent", required_argument, NULL, 'k' },
+        { "delta",        no_argument,       NULL, 'D' },
+        { "deflate",      no_argument,       NULL, 'z' },
+        { "no-verify",    no_argument,       NULL, 'N' },
+        { "format",       required_argument, NULL, 'f' },
+        { "label",        required_argument, NULL, 'L' },
+        { "stats-socket", required_argument, NULL, 'S' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "H:p:U:c:n:t:s:r:k:DzNf:L:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'U':
+            if (strlen(optarg) >= sizeof(unix_addr.sun_path))
+                print_usage(argv[0], EXIT_FAILURE);
+            config.unix_path = optarg;
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            if (config.connections <= 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'n':
+            config.requests = atol(optarg);
+            if (config.requests <= 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 't':
+            config.duration = atof(optarg);
+            if (config.duration <= 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 's':
+            if (atol(optarg) < 2)
+                print_usage(argv[0], EXIT_FAILURE);
+            config.packet_size = atol(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            if (config.rate < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'k':
+            config.seek_percent = atoi(optarg);
+            if (config.seek_percent < 0 || config.seek_percent > 100)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'D':
+            config.delta = 1;
+            break;
+        case 'z':
+            config.deflate = 1;
+            break;
+        case 'N':
+            config.verify = 0;
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0)
+                config.json = 1;
+            else if (strcmp(optarg, "text") == 0)
+                config.json = 0;
+            else
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'L':
+            config.label = optarg;
+            break;
+        case 'S':
+            if (strlen(optarg) >= sizeof(unix_addr.sun_path))
+                print_usage(argv[0], EXIT_FAILURE);
+            config.stats_path = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0], EXIT_SUCCESS);
+            break;
+        default:
+            print_usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc)
+        print_usage(argv[0], EXIT_FAILURE);
+}
+
+/* -------------------------------------------------------------------------
+ * Main
+ * ----------------------------------------------------------------------*/
+int main(int argc, char** argv)
+{
+    struct addrinfo hints;
+    struct bench_client *clients;
+    struct server_stats before, after;
+    double elapsed;
+    int started = 0;
+    int rc, i;
+
+    parse_command_line(argc, argv);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (config.unix_path) {
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, config.unix_path);
+        unix_addrinfo.ai_family = AF_UNIX;
+        unix_addrinfo.ai_socktype = SOCK_STREAM;
+        unix_addrinfo.ai_addr = (struct sockaddr *)&unix_addr;
+        unix_addrinfo.ai_addrlen = sizeof(unix_addr);
+        server_addr = &unix_addrinfo;
+        rc = 0;
+    } else {
+        rc = getaddrinfo(config.host, config.port, &hints, &server_addr);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "%s:%s: %s\n", config.host, config.port, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+
+    clients = calloc(config.connections, sizeof(struct bench_client));
+    if (!clients) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    if (config.stats_path && read_server_stats(&before) != 0)
+        return EXIT_FAILURE;
+
+    bench_start_ns = now_ns();
+    for (i = 0; i < config.connections; i++) {
+        clients[i].id = i;
+        if (pthread_create(&clients[i].thread, NULL, bench_client_main, &clients[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(clients[i].thread, NULL);
+    elapsed = (now_ns() - bench_start_ns) / 1e9;
+
+    config.connections = started;
+    if (config.stats_path && read_server_stats(&after) == 0) {
+        after.packets -= before.packets;
+        after.syncs -= before.syncs;
+        print_report(clients, elapsed > 0 ? elapsed : 1e-9, &after);
+    } else {
+        print_report(clients, elapsed > 0 ? elapsed : 1e-9, NULL);
+    }
+
+    rc = EXIT_SUCCESS;
+    for (i = 0; i < started; i++) {
+        if (clients[i].errors || clients[i].verify_failures)
+            rc = EXIT_FAILURE;
+        free(clients[i].latencies);
+    }
+    free(clients);
+    if (server_addr != &unix_addrinfo)
+        freeaddrinfo(server_addr);
+
+    return rc;
+}
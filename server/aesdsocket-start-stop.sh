@@ -2,17 +2,24 @@
 
 
 # add a startup script aesdsocket-start-stop which uses start-stop-daemon to start your aesdsocket application in daemon mode with the -d option.
+# Hot restart socket: reload starts the new binary, which takes over from the running one
+HANDOFF=/var/run/aesdsocket.handoff
+
 case "$1" in
   start)
     echo "Starting aesdsocket..."
-    start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d
+    start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d -R $HANDOFF
+    ;;
+  reload)
+    echo "Reloading aesdsocket..."
+    /usr/bin/aesdsocket -d -R $HANDOFF
     ;;
   stop)
     echo "Stopping aesdsocket..."
     start-stop-daemon -K -n aesdsocket
     ;;
   *)
-    echo "Usage: $0 {start|stop}"
+    echo "Usage: $0 {start|stop|reload}"
     exit 1
     ;;
 esac
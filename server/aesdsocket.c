@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 
 /* ---------------------------------------------------------------------------
  * Rewritten aesdsocket-style server (logic preserved)
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 
 /* --- POSIX / system headers --- */
@@ -25,37 +26,55 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <syslog.h>
+#include <getopt.h>
 
 /* --- Project headers --- */
-#include "../aesd-char-driver/aesd_ioctl.h"
-
-/* Configuration */
-#define USE_AESD_CHAR_DEVICE
-
-#ifndef USE_AESD_CHAR_DEVICE
-#define VARFILE_PATH "/var/tmp/aesdsocketdata"
-#else
-#define VARFILE_PATH "/dev/aesdchar"
-#endif
-
-#define BUFFER_SIZE 1024
+#include "aesdsocket.h"
 
 /* -------------------------------------------------------------------------
  * Globals
  * ----------------------------------------------------------------------*/
+struct server_config server_config = {
+    .daemon_mode = 0,
+    .mode = SERVER_MODE_THREADS,
+    .num_loops = 1,
+    .num_workers = 8,
+    .queue_depth = 256,
+    .reuseport = 0,
+    .tcp = 1,
+    .port = SERVER_PORT,
+    .ipv6 = 0,
+    .unix_path = NULL,
+    .stats_path = NULL,
+    .store_backend = STORE_DEFAULT_BACKEND,
+    .durability = DURABILITY_NONE,
+    .group_commit_us = GROUP_COMMIT_US_DEFAULT,
+    .group_commit_bytes = GROUP_COMMIT_BYTES_DEFAULT,
+    .max_packet_size = MAX_PACKET_SIZE_DEFAULT,
+    .send_timeout_ms = SEND_TIMEOUT_MS_DEFAULT,
+    .idle_timeout_ms = IDLE_TIMEOUT_MS_DEFAULT,
+    .output_queue_max = OUTPUT_QUEUE_MAX_DEFAULT,
+    .max_conns_per_ip = 0,
+    .rate_packets = 0,
+    .rate_bytes = 0,
+    .subscribe_ring = SUBSCRIBE_RING_DEFAULT,
+    .subscriber_skip = 0,
+};
 int server_socket_fd = -1;
-pthread_mutex_t data_mutex;
-int exit_signal_flag = 0;
+volatile sig_atomic_t exit_signal_flag = 0;
+volatile sig_atomic_t stats_dump_flag = 0;
 
 /* Manual singly linked list of clients */
 struct client_entry {
     pthread_t thread;
     int client_fd;
-    char client_ip[INET_ADDRSTRLEN];
+    uint64_t accepted_ns;
+    struct admission_slot *admission;
+    char client_ip[CLIENT_ADDR_LEN];
     int thread_done;
     struct client_entry *next;
 };
@@ -63,40 +82,34 @@ struct client_entry {
 /* Head pointer for client list */
 struct client_entry *client_list_head = NULL;
 
+/* Client entries, allocated and freed by the accepting thread only */
+static struct obj_slab client_slab;
+
 /* -------------------------------------------------------------------------
  * Forward declarations
  * ----------------------------------------------------------------------*/
 static void close_all_resources(void);
 static void handle_exit_signal(int signum);
-static void handle_timer_signal(int signum);
+static void handle_stats_signal(int signum);
 static void init_signal_handlers(void);
-#ifndef USE_AESD_CHAR_DEVICE
-static void init_periodic_timer(void);
-#endif
 static void daemonize_process(void);
 static void server_socket_init(void);
+static void parse_command_line(int argc, char** argv);
 
 static void* client_thread_main(void* arg);
-static int socket_to_file(int client_fd, FILE* data_file);
-static int file_to_socket(int client_fd, FILE* data_file);
-static int parse_ioctl_seekto(const char *str, unsigned int *x, unsigned int *y);
+static int socket_to_file(int client_fd, struct store_handle *handle,
+                          struct packet_framer *framer, uint64_t *request_ns);
+static int file_to_socket(int client_fd, struct store_handle *handle);
+static char *replay_copy_locked(struct store_handle *handle, struct store_replay *replay,
+                                size_t *len);
+static int send_reply_header(int client_fd, const struct store_handle *handle, off_t len);
+static int send_all(int client_fd, const char *buf, size_t len);
+static void client_threads_drain(void);
 
 /* -------------------------------------------------------------------------
  * Implementation
  * ----------------------------------------------------------------------*/
 
-/* Parse "AESDCHAR_IOCSEEKTO:x,y" */
-static int parse_ioctl_seekto(const char *str, unsigned int *x, unsigned int *y)
-{
-    const char *prefix = "AESDCHAR_IOCSEEKTO:";
-    size_t len = strlen(prefix);
-
-    if (strncmp(str, prefix, len) != 0)
-        return 0;
-
-    return sscanf(str + len, "%u,%u", x, y) == 2;
-}
-
 /* Signal handler for SIGINT / SIGTERM */
 void handle_exit_signal(int signum)
 {
@@ -104,28 +117,11 @@ void handle_exit_signal(int signum)
     exit_signal_flag = 1;
 }
 
-/* Timer signal handler (non-char-device mode) */
-void handle_timer_signal(int signum)
+/* Signal handler for SIGUSR1 */
+void handle_stats_signal(int signum)
 {
     (void)signum;
-#ifndef USE_AESD_CHAR_DEVICE
-    time_t now;
-    struct tm *tm_info;
-    char buf[128];
-    int fd;
-
-    time(&now);
-    tm_info = localtime(&now);
-
-    strftime(buf, sizeof(buf), "timestamp:%a, %d %b %Y %T %z\n", tm_info);
-
-    pthread_mutex_lock(&data_mutex);
-    fd = open(VARFILE_PATH, O_WRONLY | O_APPEND | O_CREAT, 0640);
-    write(fd, buf, strlen(buf));
-    pthread_mutex_unlock(&data_mutex);
-
-    close(fd);
-#endif
+    stats_dump_flag = 1;
 }
 
 /* Register signal handlers */
@@ -140,24 +136,13 @@ void init_signal_handlers(void)
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
-    sa.sa_handler = handle_timer_signal;
-    sigaction(SIGALRM, &sa, NULL);
-}
-
-#ifndef USE_AESD_CHAR_DEVICE
-/* Create 10-second periodic timer */
-void init_periodic_timer(void)
-{
-    timer_t timer_id;
-    struct itimerspec itval = {0};
-
-    itval.it_value.tv_sec = 10;
-    itval.it_interval.tv_sec = 10;
+    /* sendfile/splice have no MSG_NOSIGNAL: report EPIPE instead */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 
-    timer_create(CLOCK_REALTIME, NULL, &timer_id);
-    timer_settime(timer_id, 0, &itval, NULL);
+    sa.sa_handler = handle_stats_signal;
+    sigaction(SIGUSR1, &sa, NULL);
 }
-#endif
 
 /* Detach and run as daemon */
 void daemonize_process(void)
@@ -169,7 +154,7 @@ void daemonize_process(void)
         exit(EXIT_FAILURE);
     }
     if (pid > 0) {
-        close_all_resources();
+        /* The child owns the listeners now, AF_UNIX path included */
         exit(EXIT_SUCCESS);
     }
 
@@ -180,116 +165,605 @@ void daemonize_process(void)
     close(STDERR_FILENO);
 }
 
-/* Initialize server socket */
+/* Bind the listeners */
 void server_socket_init(void)
 {
-    struct addrinfo hints, *res;
-    int optval = 1;
-
-    server_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (server_socket_fd < 0) {
+    if (listeners_open() != 0) {
         close_all_resources();
         exit(EXIT_FAILURE);
     }
+}
 
-    setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+/*
+ * Handle a single client: store its packet, replay the data, and hand
+ * it to aesd-pubsub.c if it subscribed. Keep-alive clients loop here,
+ * one framed reply per request, until they close or idle_timeout_ms
+ * passes without one (SO_RCVTIMEO).
+ * SO_SNDTIMEO bounds every send, sendfile and splice: a client that
+ * accepts no replay bytes for send_timeout_ms is dropped.
+ */
+void client_session_run(int client_fd, const char *client_ip,
+                        struct admission_slot *admission, uint64_t accepted_ns)
+{
+    struct store_handle handle;
+    struct packet_framer framer;
+    uint64_t request_ns = accepted_ns;
+    int subscribed = 0;
+    int keepalive = 0;
+
+    if (server_config.send_timeout_ms > 0) {
+        struct timeval tv;
+
+        tv.tv_sec = server_config.send_timeout_ms / 1000;
+        tv.tv_usec = (server_config.send_timeout_ms % 1000) * 1000;
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags    = AI_PASSIVE;
+    if (store_open(&handle) == 0) {
+        framer_init(&framer);
+        framer.admission = admission;
+
+        while (1) {
+            framer.rate_limited = 0;
+            if (!socket_to_file(client_fd, &handle, &framer, &request_ns)) {
+                /* EAGAIN is also a rate limit drop, already logged and counted */
+                if (keepalive && !framer.rate_limited &&
+                    (errno == EAGAIN || errno == EWOULDBLOCK))
+                    client_close_idle(client_ip);
+                break;
+            }
+            if (!file_to_socket(client_fd, &handle)) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    client_evict_slow(client_ip);
+                break;
+            }
+            if (handle.subscribe) {
+                subscribed = pubsub_subscribe(client_fd, client_ip, &handle) == 0;
+                break;
+            }
+            if (!handle.keepalive)
+                break;
 
-    if (getaddrinfo(NULL, "9000", &hints, &res) != 0) {
-        close_all_resources();
-        exit(EXIT_FAILURE);
-    }
+            metrics_request_done(request_ns);
+            request_ns = 0;
+            if (!keepalive) {
+                keepalive = 1;
+                client_keepalive_socket(client_fd);
+                if (server_config.idle_timeout_ms > 0) {
+                    struct timeval tv;
+
+                    tv.tv_sec = server_config.idle_timeout_ms / 1000;
+                    tv.tv_usec = (server_config.idle_timeout_ms % 1000) * 1000;
+                    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                }
+            }
+        }
 
-    if (bind(server_socket_fd, res->ai_addr, res->ai_addrlen) != 0) {
-        close_all_resources();
-        freeaddrinfo(res);
-        exit(EXIT_FAILURE);
+        framer_free(&framer);
+        store_close(&handle);
     }
 
-    freeaddrinfo(res);
+    /* EOF now: the threads engine closes client_fd only at the next accept */
+    if (!subscribed)
+        shutdown(client_fd, SHUT_WR);
+    metrics_conn_closed(request_ns);
+}
+
+void client_evict_slow(const char *client_ip)
+{
+    syslog(LOG_WARNING, "Evicting %s: replay stalled for %d ms", client_ip,
+           server_config.send_timeout_ms);
+    metrics_slow_client_evicted();
+}
+
+void client_close_idle(const char *client_ip)
+{
+    syslog(LOG_INFO, "Closing %s: no request for %d ms", client_ip,
+           server_config.idle_timeout_ms);
+    metrics_idle_closed();
+}
+
+/* Replies are small and answered one at a time: no Nagle delay between them */
+void client_keepalive_socket(int client_fd)
+{
+    int one = 1;
+
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
 /* Thread routine: handle a single client */
 void* client_thread_main(void* arg)
 {
     struct client_entry *client = arg;
-    FILE* data_file;
-
-    pthread_mutex_lock(&data_mutex);
-    data_file = fopen(VARFILE_PATH, "w+");
 
-    socket_to_file(client->client_fd, data_file);
-    file_to_socket(client->client_fd, data_file);
-
-    fclose(data_file);
-    pthread_mutex_unlock(&data_mutex);
+    client_session_run(client->client_fd, client->client_ip, client->admission,
+                       client->accepted_ns);
+    admission_release(client->admission);
 
     client->thread_done = 1;
     return NULL;
 }
 
-/* Receive data and write to file (handle ioctl command) */
-int socket_to_file(int client_fd, FILE* data_file)
+/*
+ * Receive until every buffered packet is complete, storing them as they
+ * arrive; on a keep-alive connection until the next packet is. The clock
+ * in *request_ns starts with the first byte of a request. 0 with errno
+ * set (0 on EOF) when the client is gone or the request failed.
+ */
+int socket_to_file(int client_fd, struct store_handle *handle,
+                   struct packet_framer *framer, uint64_t *request_ns)
 {
-    char buf[BUFFER_SIZE + 1];
-    int n;
-    struct aesd_seekto seek;
+    int rc = framer_next_request(framer, handle);
 
-    do {
-        n = recv(client_fd, buf, BUFFER_SIZE, 0);
-        buf[n] = '\0';
+    if (rc > 0 && *request_ns == 0)
+        *request_ns = metrics_now_ns();
+    if (rc != 0)
+        return rc > 0;
 
-        if (parse_ioctl_seekto(buf, &seek.write_cmd, &seek.write_cmd_offset)) {
-#ifdef DEBUG
-            fprintf(stderr, "ioctl: %u %u\n", seek.write_cmd, seek.write_cmd_offset);
-#endif
-            ioctl(fileno(data_file), AESDCHAR_IOCSEEKTO, &seek);
-        } else {
-#ifdef DEBUG
-            fprintf(stderr, "to file: %s\n", buf);
-#endif
-            fwrite(buf, 1, n, data_file);
-            fflush(data_file);
+    while (1) {
+        size_t room;
+        char *buf = framer_reserve(framer, &room);
+        ssize_t n;
+
+        if (!buf)
+            return 0;
+
+        n = recv(client_fd, buf, room, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = 0;
+        if (n <= 0)
+            return 0;
+        if (*request_ns == 0)
+            *request_ns = metrics_now_ns();
+
+        framer_commit(framer, n);
+        n = framer_process(framer, handle);
+        if (n < 0)
+            return 0;
+        if (framer_request_done(framer, handle, n))
+            return 1;
+    }
+}
+
+/*
+ * Copy a replay that holds the store lock into one buffer and release the
+ * lock, so appends never wait on this client's socket. At most
+ * output_queue_max bytes; NULL with errno set otherwise.
+ */
+char *replay_copy_locked(struct store_handle *handle, struct store_replay *replay,
+                         size_t *len)
+{
+    char *queue = NULL;
+    size_t cap = 0;
+    ssize_t n;
+
+    *len = 0;
+    while (1) {
+        if (cap - *len < BUFFER_SIZE) {
+            size_t new_cap = cap ? cap * 2 : BUFFER_SIZE * 4;
+            char *grown;
+
+            if (new_cap > server_config.output_queue_max) {
+                syslog(LOG_WARNING, "replay exceeds the %zu byte output queue",
+                       server_config.output_queue_max);
+                errno = EMSGSIZE;
+                break;
+            }
+            grown = realloc(queue, new_cap);
+            if (!grown)
+                break;
+            queue = grown;
+            cap = new_cap;
         }
 
-    } while (buf[n - 1] != '\n');
+        n = store_replay_read(handle, replay, queue + *len, cap - *len);
+        if (n == 0) {
+            replay->end = replay->pos;
+            store_replay_end(replay);
+            return queue;
+        }
+        if (n < 0)
+            break;
+        *len += n;
+    }
 
-    return 1;
+    free(queue);
+    return NULL;
 }
 
-/* Read file contents and send to client */
-int file_to_socket(int client_fd, FILE* data_file)
+/* Read file contents and send to client; 0 with errno set on failure */
+int file_to_socket(int client_fd, struct store_handle *handle)
 {
     char buf[BUFFER_SIZE + 1];
-    int n;
+    struct store_replay replay;
+    ssize_t n;
+    int rc = 1;
+    int saved_errno;
+
+    store_replay_begin(handle, &replay);
+
+    if (replay.locked) {
+        size_t len;
+        char *queue = replay_copy_locked(handle, &replay, &len);
+
+        rc = queue && send_reply_header(client_fd, handle, len) == 0 &&
+             send_all(client_fd, queue, len) == 0;
+        saved_errno = errno;
+        free(queue);
+        goto done;
+    }
+
+    if (send_reply_header(client_fd, handle, store_replay_remaining(&replay)) != 0) {
+        rc = 0;
+        saved_errno = errno;
+        goto done;
+    }
+
+    /* Zero-copy first; whatever it could not send is copied below */
+    while ((n = store_replay_send(handle, &replay, client_fd)) > 0 ||
+           (n < 0 && errno == EINTR))
+        ;
+    if (n < 0 && errno != EOPNOTSUPP)
+        rc = 0;
 
-    while ((n = fread(buf, 1, BUFFER_SIZE, data_file)) > 0) {
+    while (rc && (n = store_replay_read(handle, &replay, buf, BUFFER_SIZE)) > 0) {
         buf[n] = '\0';
 #ifdef DEBUG
         fprintf(stderr, "from file: %s\n", buf);
 #endif
-        send(client_fd, buf, n, 0);
+        rc = (send_all(client_fd, buf, n) == 0);
+    }
+    saved_errno = errno;
+
+done:
+    metrics_replay_done(replay.pos - replay.start);
+    store_replay_end(&replay);
+    errno = saved_errno;
+    return rc;
+}
+
+/* Keep-alive and binary replies start with a header holding their length */
+int send_reply_header(int client_fd, const struct store_handle *handle, off_t len)
+{
+    char header[REPLY_HEADER_MAX];
+
+    if (!handle->keepalive)
+        return 0;
+    return send_all(client_fd, header,
+                    store_reply_header(handle, header, sizeof(header), len));
+}
+
+/* Send a whole buffer on a blocking socket; EAGAIN once SO_SNDTIMEO expires */
+int send_all(int client_fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(client_fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Block until SIGINT/SIGTERM; SIGUSR1 keeps being serviced meanwhile */
+void wait_for_exit_signal(void (*on_stats)(void))
+{
+    sigset_t block_mask, wait_mask;
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &wait_mask);
+
+    while (!exit_signal_flag) {
+        sigsuspend(&wait_mask);
+        if (stats_dump_flag) {
+            stats_dump_flag = 0;
+            if (on_stats)
+                on_stats();
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+}
+
+/* Hot restart: clients get HANDOFF_DRAIN_MS to finish, then see EOF */
+void client_threads_drain(void)
+{
+    uint64_t deadline = metrics_now_ns() + (uint64_t)HANDOFF_DRAIN_MS * 1000000u;
+    struct client_entry *cur;
+    int busy = 1;
+
+    while (busy && metrics_now_ns() < deadline) {
+        busy = 0;
+        for (cur = client_list_head; cur; cur = cur->next)
+            busy |= !cur->thread_done;
+        if (busy)
+            usleep(10000);
     }
 
-    return 1;
+    for (cur = client_list_head; cur; cur = cur->next) {
+        if (!cur->thread_done)
+            shutdown(cur->client_fd, SHUT_RDWR);
+    }
 }
 
 /* Close all system resources */
 void close_all_resources(void)
 {
-    if (server_socket_fd != -1)
-        close(server_socket_fd);
+    handoff_server_stop();
+    listeners_close();
+
+    metrics_server_stop();
+    timestamp_timer_stop();
+    replication_stop();
+    pubsub_stop();
+    handoff_finish();
+    store_cleanup();
+    rxbuf_cache_drain();
+    admission_cleanup();
+    closelog();
+}
 
-#ifndef USE_AESD_CHAR_DEVICE
-    remove(VARFILE_PATH);
-#endif
+/* Print usage and exit */
+static void print_usage(const char *prog, int status)
+{
+    fprintf(stderr,
+            "Usage: %s [-d] [-m threads|epoll|pool|uring] [-l loops] [-r] [-w workers] [-q depth]\n"
+            "          [-b backend] [-S path] [-M bytes] [-T ms] [-o bytes]\n"
+            "          [-C conns] [-P packets/s] [-B bytes/s] [-6] [-U path] [-N]\n"
+            "          [-R path] [-p port] [-Y port] [-F host:port] [-g bytes]\n"
+            "          [-k drop|skip] [-I ms] [-D none|packet|group] [-W us] [-G bytes]\n"
+            "  -d, --daemon          run in the background\n"
+            "  -m, --mode MODE       connection handling: threads (default), epoll,\n"
+            "                        pool or uring (falls back to epoll)\n"
+            "  -l, --loops N         epoll/uring loops, 0 = one per online CPU (default 1)\n"
+            "  -r, --reuseport       one SO_REUSEPORT listener per loop, loops pinned\n"
+            "                        to CPUs (epoll and uring)\n"
+            "  -w, --workers N       pool workers, 0 = one per online CPU (default 8)\n"
+            "  -q, --queue-depth N   pool accept queue depth (default 256)\n"
+            "  -b, --backend NAME    store: chardev, file, mmap or memory\n"
+            "                        (default " STORE_DEFAULT_BACKEND ")\n"
+            "  -S, --stats-socket P  serve counters and latency percentiles on\n"
+            "                        the AF_UNIX socket P\n"
+            "  -M, --max-packet N    drop clients sending a packet longer than N\n"
+            "                        bytes, 0 = no limit (default 16 MiB)\n"
+            "  -T, --send-timeout MS drop clients whose replay makes no progress\n"
+            "                        for MS milliseconds, 0 = never (default 10000)\n"
+            "  -o, --output-queue N  replay bytes buffered per client before it is\n"
+            "                        dropped (default 64 MiB)\n"
+            "  -C, --max-conns-per-ip N  connections one client address may hold\n"
+            "                        open, 0 = no limit (default)\n"
+            "  -P, --rate-packets N  packets per second per client address,\n"
+            "                        0 = no limit (default)\n"
+            "  -B, --rate-bytes N    bytes per second per client address,\n"
+            "                        0 = no limit (default)\n"
+            "  -6, --ipv6            listen on IPv6, dual-stack: IPv4 clients connect\n"
+            "                        through the same socket\n"
+            "  -U, --unix PATH       also listen on the AF_UNIX stream socket PATH\n"
+            "  -N, --no-tcp          no TCP listener, only --unix\n"
+            "  -R, --handoff PATH    hot restart: take over the listeners and store\n"
+            "                        of the instance serving PATH, if any, then\n"
+            "                        serve PATH for the next upgrade\n"
+            "  -p, --port PORT       TCP port for clients (default " SERVER_PORT ")\n"
+            "  -Y, --replication-port PORT  stream the store to replicas connecting\n"
+            "                        to PORT\n"
+            "  -F, --replica-of HOST:PORT  read-only replica of the primary serving\n"
+            "                        replication on HOST:PORT ([v6addr]:PORT)\n"
+            "  -g, --subscribe-ring N  bytes of recent appends kept for\n"
+            "                        AESDREPLAY:subscribe clients, 0 = no\n"
+            "                        subscriptions (default 4 MiB)\n"
+            "  -k, --subscriber-lag P  subscribers that fall further behind are\n"
+            "                        dropped (drop, default) or resume with the\n"
+            "                        next append (skip)\n"
+            "  -I, --idle-timeout MS close keep-alive connections that send no\n"
+            "                        request for MS milliseconds, 0 = never\n"
+            "                        (default 30000)\n"
+            "  -D, --durability MODE when an append counts as done, for backends\n"
+            "                        that sync (file): none (default), packet\n"
+            "                        (fdatasync each) or group (shared fdatasync)\n"
+            "  -W, --group-window US group commit: wait up to US microseconds for\n"
+            "                        more appends, 0 = sync at once (default 1000)\n"
+            "  -G, --group-bytes N   group commit: sync early once N bytes wait\n"
+            "                        (default 1 MiB)\n",
+            prog);
+    exit(status);
+}
 
-    pthread_mutex_destroy(&data_mutex);
-    closelog();
+/* Byte count option: decimal, no sign */
+static int parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (*arg == '-' || end == arg || *end != '\0' || errno != 0 || value > SIZE_MAX)
+        return -1;
+    *size = value;
+    return 0;
+}
+
+/* Fill server_config from argv */
+void parse_command_line(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "daemon", no_argument,       NULL, 'd' },
+        { "mode",   required_argument, NULL, 'm' },
+        { "loops",  required_argument, NULL, 'l' },
+        { "reuseport", no_argument,    NULL, 'r' },
+        { "workers", required_argument, NULL, 'w' },
+        { "queue-depth", required_argument, NULL, 'q' },
+        { "backend", required_argument, NULL, 'b' },
+        { "stats-socket", required_argument, NULL, 'S' },
+        { "max-packet", required_argument, NULL, 'M' },
+        { "send-timeout", required_argument, NULL, 'T' },
+        { "output-queue", required_argument, NULL, 'o' },
+        { "max-conns-per-ip", required_argument, NULL, 'C' },
+        { "rate-packets", required_argument, NULL, 'P' },
+        { "rate-bytes", required_argument, NULL, 'B' },
+        { "ipv6",   no_argument,       NULL, '6' },
+        { "unix",   required_argument, NULL, 'U' },
+        { "no-tcp", no_argument,       NULL, 'N' },
+        { "handoff", required_argument, NULL, 'R' },
+        { "port",   required_argument, NULL, 'p' },
+        { "replication-port", required_argument, NULL, 'Y' },
+        { "replica-of", required_argument, NULL, 'F' },
+        { "subscribe-ring", required_argument, NULL, 'g' },
+        { "subscriber-lag", required_argument, NULL, 'k' },
+        { "idle-timeout", required_argument, NULL, 'I' },
+        { "durability", required_argument, NULL, 'D' },
+        { "group-window", required_argument, NULL, 'W' },
+        { "group-bytes", required_argument, NULL, 'G' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "dm:l:rw:q:b:S:M:T:o:C:P:B:6U:NR:p:Y:F:g:k:I:D:W:G:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            server_config.daemon_mode = 1;
+            break;
+        case 'm':
+            if (strcmp(optarg, "threads") == 0)
+                server_config.mode = SERVER_MODE_THREADS;
+            else if (strcmp(optarg, "epoll") == 0)
+                server_config.mode = SERVER_MODE_EPOLL;
+            else if (strcmp(optarg, "pool") == 0)
+                server_config.mode = SERVER_MODE_POOL;
+            else if (strcmp(optarg, "uring") == 0)
+                server_config.mode = SERVER_MODE_URING;
+            else
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'l':
+            server_config.num_loops = atoi(optarg);
+            if (server_config.num_loops < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'r':
+            server_config.reuseport = 1;
+            break;
+        case 'w':
+            server_config.num_workers = atoi(optarg);
+            if (server_config.num_workers < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'q':
+            if (atoi(optarg) <= 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            server_config.queue_depth = atoi(optarg);
+            break;
+        case 'b':
+            if (!store_backend_find(optarg))
+                print_usage(argv[0], EXIT_FAILURE);
+            server_config.store_backend = optarg;
+            break;
+        case 'S':
+            server_config.stats_path = optarg;
+            break;
+        case 'M':
+            if (parse_size(optarg, &server_config.max_packet_size) != 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'T':
+            server_config.send_timeout_ms = atoi(optarg);
+            if (server_config.send_timeout_ms < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'o':
+            if (parse_size(optarg, &server_config.output_queue_max) != 0 ||
+                server_config.output_queue_max < BUFFER_SIZE * 4)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'C':
+            if (atoi(optarg) < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            server_config.max_conns_per_ip = atoi(optarg);
+            break;
+        case 'P':
+            if (atoi(optarg) < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            server_config.rate_packets = atoi(optarg);
+            break;
+        case 'B':
+            if (parse_size(optarg, &server_config.rate_bytes) != 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case '6':
+            server_config.ipv6 = 1;
+            break;
+        case 'U':
+            server_config.unix_path = optarg;
+            break;
+        case 'N':
+            server_config.tcp = 0;
+            break;
+        case 'R':
+            server_config.handoff_path = optarg;
+            break;
+        case 'p':
+            server_config.port = optarg;
+            break;
+        case 'Y':
+            server_config.replication_port = optarg;
+            break;
+        case 'F':
+            server_config.replica_of = optarg;
+            break;
+        case 'g':
+            if (parse_size(optarg, &server_config.subscribe_ring) != 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'k':
+            if (strcmp(optarg, "drop") == 0)
+                server_config.subscriber_skip = 0;
+            else if (strcmp(optarg, "skip") == 0)
+                server_config.subscriber_skip = 1;
+            else
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'I':
+            server_config.idle_timeout_ms = atoi(optarg);
+            if (server_config.idle_timeout_ms < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'D':
+            if (strcmp(optarg, "none") == 0)
+                server_config.durability = DURABILITY_NONE;
+            else if (strcmp(optarg, "packet") == 0)
+                server_config.durability = DURABILITY_PACKET;
+            else if (strcmp(optarg, "group") == 0)
+                server_config.durability = DURABILITY_GROUP;
+            else
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'W':
+            server_config.group_commit_us = atoi(optarg);
+            if (server_config.group_commit_us < 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'G':
+            if (parse_size(optarg, &server_config.group_commit_bytes) != 0)
+                print_usage(argv[0], EXIT_FAILURE);
+            break;
+        case 'h':
+            print_usage(argv[0], EXIT_SUCCESS);
+            break;
+        default:
+            print_usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc || (!server_config.tcp && !server_config.unix_path))
+        print_usage(argv[0], EXIT_FAILURE);
 }
 
 /* -------------------------------------------------------------------------
@@ -297,22 +771,79 @@ void close_all_resources(void)
  * ----------------------------------------------------------------------*/
 int main(int argc, char** argv)
 {
-    int daemon_mode = (argc == 2 && strcmp(argv[1], "-d") == 0);
+    int rc;
 
-    pthread_mutex_init(&data_mutex, NULL);
+    parse_command_line(argc, argv);
 
     openlog(NULL, 0, LOG_USER);
+    admission_init();
     init_signal_handlers();
-    server_socket_init();
 
-    if (daemon_mode)
+    /* A running instance on the handoff socket gives us its listeners */
+    rc = server_config.handoff_path ? handoff_takeover() : 0;
+    if (rc < 0) {
+        close_all_resources();
+        exit(EXIT_FAILURE);
+    }
+    if (rc == 0)
+        server_socket_init();
+
+    if (server_config.daemon_mode)
         daemonize_process();
 
-#ifndef USE_AESD_CHAR_DEVICE
-    init_periodic_timer();
-#endif
+    if (handoff_store_init() != 0) {
+        close_all_resources();
+        exit(EXIT_FAILURE);
+    }
+
+    /* Metrics are recorded either way; the socket only exposes them */
+    if (server_config.stats_path)
+        metrics_server_start(server_config.stats_path);
 
-    listen(server_socket_fd, 1024);
+    /* Before anything appends: ring positions start at the store size */
+    if (pubsub_start() != 0) {
+        close_all_resources();
+        exit(EXIT_FAILURE);
+    }
+
+    if ((server_config.replication_port && replication_server_start() != 0) ||
+        (server_config.replica_of && replica_start() != 0)) {
+        close_all_resources();
+        exit(EXIT_FAILURE);
+    }
+
+    /* The driver keeps no timestamps; a replica gets the primary's */
+    if (!store_is_device() && !server_config.replica_of && timestamp_timer_start() != 0) {
+        close_all_resources();
+        exit(EXIT_FAILURE);
+    }
+
+    if (listeners_start() != 0) {
+        syslog(LOG_ERR, "listen: %s", strerror(errno));
+        close_all_resources();
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_config.handoff_path)
+        handoff_server_start();
+
+    if (server_config.mode != SERVER_MODE_THREADS) {
+        switch (server_config.mode) {
+        case SERVER_MODE_EPOLL:
+            rc = epoll_server_run();
+            break;
+        case SERVER_MODE_URING:
+            rc = uring_server_run();
+            break;
+        default:
+            rc = pool_server_run();
+            break;
+        }
+        close_all_resources();
+        return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    slab_init(&client_slab, sizeof(struct client_entry), 64);
 
     while (1) {
 
@@ -333,7 +864,7 @@ int main(int argc, char** argv)
 
                 struct client_entry *to_free = cur;
                 cur = cur->next;
-                free(to_free);
+                slab_free(&client_slab, to_free);
                 continue;
             }
             prev = cur;
@@ -341,31 +872,50 @@ int main(int argc, char** argv)
         }
 
         /* Accept new client */
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
+        char ip[CLIENT_ADDR_LEN];
+        struct admission_slot *admission;
 
-        int new_fd = accept(server_socket_fd, (struct sockaddr*)&client_addr, &addr_len);
+        int new_fd = listeners_accept(ip, sizeof(ip));
         if (new_fd < 0) {
             if (exit_signal_flag)
                 break;
             continue;
         }
 
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        /* Turned away before it costs a thread */
+        if (admission_acquire(ip, &admission) != 0) {
+            close(new_fd);
+            continue;
+        }
         syslog(LOG_INFO, "Accepted connection from %s", ip);
 
         /* Allocate new list node */
-        struct client_entry *new_node = calloc(1, sizeof(struct client_entry));
+        struct client_entry *new_node = slab_alloc(&client_slab);
+        if (!new_node) {
+            admission_release(admission);
+            close(new_fd);
+            continue;
+        }
         new_node->client_fd = new_fd;
+        new_node->admission = admission;
+        new_node->accepted_ns = metrics_now_ns();
+        metrics_conn_accepted();
         strcpy(new_node->client_ip, ip);
         new_node->thread_done = 0;
         new_node->next = client_list_head;
         client_list_head = new_node;
 
+        /* Keep signal handlers on this thread, never inside a client */
+        sigset_t all_signals, old_mask;
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
         pthread_create(&new_node->thread, NULL, client_thread_main, new_node);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
     }
 
+    if (handoff_draining())
+        client_threads_drain();
+
     /* Final cleanup: join & free all clients */
     struct client_entry *cur = client_list_head;
     while (cur) {
@@ -374,9 +924,10 @@ int main(int argc, char** argv)
         syslog(LOG_INFO, "Closed connection from %s", cur->client_ip);
 
         struct client_entry *next = cur->next;
-        free(cur);
+        slab_free(&client_slab, cur);
         cur = next;
     }
+    slab_destroy(&client_slab);
 
     close_all_resources();
     return EXIT_SUCCESS;
@@ -0,0 +1,716 @@
+/*
+ * aesdsocket.h
+ *
+ * Declarations shared between the aesdsocket translation units: build
+ * configuration, runtime options and the process-wide state owned by
+ * aesdsocket.c.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* Opaque outside their modules */
+struct admission_slot;
+struct replay_deflate;
+
+/* Configuration */
+#define USE_AESD_CHAR_DEVICE
+
+#define AESDCHAR_PATH "/dev/aesdchar"
+#define DATAFILE_PATH "/var/tmp/aesdsocketdata"
+
+/* Store backend used unless --backend names another */
+#ifdef USE_AESD_CHAR_DEVICE
+#define STORE_DEFAULT_BACKEND "chardev"
+#else
+#define STORE_DEFAULT_BACKEND "mmap"
+#endif
+
+#define BUFFER_SIZE 1024
+#define SERVER_PORT "9000"
+#define LISTEN_BACKLOG 1024
+#define TIMESTAMP_INTERVAL_S 10
+
+/* TCP plus AF_UNIX */
+#define MAX_LISTENERS 2
+/* Client names: IPv6 text or "unix:uid=N" */
+#define CLIENT_ADDR_LEN INET6_ADDRSTRLEN
+
+/* Receive buffers start at this size and grow with the packets */
+#define RXBUF_INITIAL_CAP (BUFFER_SIZE * 4)
+/* Longest packet accepted unless --max-packet says otherwise */
+#define MAX_PACKET_SIZE_DEFAULT ((size_t)16 << 20)
+/* A replay that makes no progress for this long drops the client */
+#define SEND_TIMEOUT_MS_DEFAULT 10000
+/* Replay bytes one connection may hold in memory */
+#define OUTPUT_QUEUE_MAX_DEFAULT ((size_t)64 << 20)
+/* Subscribers that fall this far behind the appends are dropped or skipped */
+#define SUBSCRIBE_RING_DEFAULT ((size_t)4 << 20)
+/* Keep-alive connections with no request for this long are closed */
+#define IDLE_TIMEOUT_MS_DEFAULT 30000
+/* Keep-alive reply header, "AESDREPLY:<bytes>\n" */
+#define REPLY_HEADER "AESDREPLY:"
+#define REPLY_HEADER_MAX 32
+/* After a hot restart, connections still open this long are closed */
+#define HANDOFF_DRAIN_MS 5000
+/* Group commit: a sync waits this long for more appends, or this many bytes */
+#define GROUP_COMMIT_US_DEFAULT 1000
+#define GROUP_COMMIT_BYTES_DEFAULT ((size_t)1 << 20)
+
+/*
+ * Binary protocol, chosen by sending BINARY_PREAMBLE first: records of a
+ * binary_header and header.length payload bytes, so payloads may hold
+ * any byte. Every record but a quiet APPEND gets a reply record with the
+ * same opcode, the errno of the request in status (0 = done) and the
+ * reply payload: the replay, the stats report, or nothing. REPLAY and
+ * SEEKTO both reply with a replay; an empty REPLAY is always a full one.
+ */
+#define BINARY_PREAMBLE "\0AESDBIN"
+#define BINARY_PREAMBLE_LEN 8
+
+enum binary_opcode {
+    BINARY_OP_APPEND = 1,   /* payload: one packet */
+    BINARY_OP_REPLAY,       /* payload: none (whole store), or a 64-bit start offset */
+    BINARY_OP_SEEKTO,       /* payload: 32-bit write command and offset */
+    BINARY_OP_STATS,        /* payload: none, replies with metrics_format() */
+};
+
+/* APPEND without a reply; a failure is reported by the next reply */
+#define BINARY_FLAG_QUIET 0x01
+
+/* Integers big-endian */
+struct binary_header {
+    uint8_t opcode;
+    uint8_t flags;          /* request: BINARY_FLAG_*; reply: 0 */
+    uint8_t status;         /* reply: errno, 0 = done; request: 0 */
+    uint8_t reserved;
+    uint32_t length;        /* payload bytes */
+};
+
+/* Connection handling strategy selected with --mode */
+enum server_mode {
+    SERVER_MODE_THREADS,    /* one pthread per accepted connection */
+    SERVER_MODE_EPOLL,      /* non-blocking, edge-triggered epoll loops */
+    SERVER_MODE_POOL,       /* fixed worker pool fed by the acceptor */
+    SERVER_MODE_URING,      /* io_uring completion loops, epoll if unsupported */
+};
+
+/* When an append is acknowledged, selected with --durability */
+enum store_durability {
+    DURABILITY_NONE,        /* once written: the page cache decides */
+    DURABILITY_PACKET,      /* after its own fdatasync */
+    DURABILITY_GROUP,       /* after an fdatasync shared with concurrent appends */
+};
+
+/* Runtime options parsed from the command line */
+struct server_config {
+    int daemon_mode;
+    enum server_mode mode;
+    int num_loops;          /* epoll/uring loops, 0 = one per online CPU */
+    int num_workers;        /* pool workers, 0 = one per online CPU */
+    size_t queue_depth;     /* pool queue cells, rounded up to a power of 2 */
+    int reuseport;          /* one SO_REUSEPORT listener per loop */
+    int tcp;                /* listen on port */
+    const char *port;       /* TCP port, SERVER_PORT by default */
+    int ipv6;               /* TCP listener is IPv6 dual-stack */
+    const char *unix_path;  /* AF_UNIX listener, NULL = none */
+    const char *stats_path; /* AF_UNIX stats socket, NULL = none */
+    const char *handoff_path; /* AF_UNIX hot restart socket, NULL = none */
+    const char *replication_port; /* serve replicas on this TCP port, NULL = none */
+    const char *replica_of; /* HOST:PORT of the primary, NULL = not a replica */
+    size_t subscribe_ring;  /* bytes of appends kept for subscribers, 0 = none */
+    int subscriber_skip;    /* lapped subscribers skip ahead instead of dropping */
+    const char *store_backend;
+    enum store_durability durability;   /* backends with a sync hook */
+    int group_commit_us;    /* group commit time window, 0 = sync right away */
+    size_t group_commit_bytes; /* a full byte window syncs early */
+    size_t max_packet_size; /* bytes including the newline, 0 = unlimited */
+    int send_timeout_ms;    /* slow client eviction, 0 = never */
+    int idle_timeout_ms;    /* idle keep-alive connections, 0 = never closed */
+    size_t output_queue_max; /* per-connection replay buffer limit */
+    unsigned max_conns_per_ip; /* 0 = unlimited */
+    unsigned rate_packets;  /* packets per second per client address, 0 = unlimited */
+    size_t rate_bytes;      /* bytes per second per client address, 0 = unlimited */
+};
+
+/* -------------------------------------------------------------------------
+ * Globals (aesdsocket.c)
+ * ----------------------------------------------------------------------*/
+extern struct server_config server_config;
+extern int server_socket_fd;          /* TCP listener, -1 without TCP */
+extern volatile sig_atomic_t exit_signal_flag;
+extern volatile sig_atomic_t stats_dump_flag;
+
+/*
+ * Serve one client on a blocking socket; the caller closes client_fd.
+ * accepted_ns (metrics_now_ns()) starts the request latency clock and
+ * admission is the slot from admission_acquire(), NULL without limits.
+ * The client sees EOF when this returns, unless it subscribed.
+ */
+void client_session_run(int client_fd, const char *client_ip,
+                        struct admission_slot *admission, uint64_t accepted_ns);
+
+/* Log and count a client dropped for not reading its replay */
+void client_evict_slow(const char *client_ip);
+
+/* Log and count a keep-alive client closed after idle_timeout_ms */
+void client_close_idle(const char *client_ip);
+
+/* Socket options for a connection that just turned keep-alive */
+void client_keepalive_socket(int client_fd);
+
+/* Engines park the main thread here until SIGINT/SIGTERM; SIGUSR1 calls on_stats */
+void wait_for_exit_signal(void (*on_stats)(void));
+
+/* -------------------------------------------------------------------------
+ * Listeners (aesd-listen.c)
+ * ----------------------------------------------------------------------*/
+
+/* Bind every configured listener; listeners_start() makes them listen */
+int listeners_open(void);
+int listeners_start(void);
+void listeners_close(void);
+int listeners_count(void);
+int listeners_fd(int index);
+
+/*
+ * Hot restart. The successor adopts already listening sockets, the TCP
+ * one at tcp_index (-1 for none) plus the AF_UNIX path they serve ("" for
+ * none), in place of listeners_open(); the predecessor disowns that path
+ * so closing its copies leaves the socket file alone.
+ */
+int listeners_adopt(const int *fds, int count, int tcp_index, const char *path);
+void listeners_disown(void);
+const char *listeners_unix_path(void);
+int listeners_tcp_index(void);
+
+/* Another bound, not yet listening TCP socket for the client port; -1 on failure */
+int server_listener_open(void);
+
+/* The same for any port, e.g. replication; -1 on failure */
+int tcp_listener_open(const char *port, int reuseport);
+
+/* Name a client for logs and admission control, CLIENT_ADDR_LEN bytes */
+void client_addr_format(int fd, const struct sockaddr_storage *addr, char *name, size_t size);
+
+/*
+ * Blocking accept on whichever listener is ready first, for the
+ * engines with a single acceptor thread. Returns the client socket and
+ * its name, or -1 with errno set (EINTR when a signal arrived).
+ */
+int listeners_accept(char *name, size_t size);
+
+/* -------------------------------------------------------------------------
+ * Data store (aesd-store.c)
+ * ----------------------------------------------------------------------*/
+
+/* A client's view of the store */
+struct store_handle {
+    int fd;
+    int seeked;             /* AESDCHAR_IOCSEEKTO moved the read position */
+    off_t replay_from;      /* AESDREPLAY offset, -1 = whole store */
+    off_t opened_size;      /* store size when the client connected */
+    int deflate;            /* AESDREPLAY:deflate, replays are gzip compressed */
+    int subscribe;          /* AESDREPLAY:subscribe, stay for new packets */
+    int keepalive;          /* AESDREPLAY:keepalive, framed replies, stay open */
+    int binary;             /* binary protocol, always keep-alive */
+    int reply_op;           /* binary: enum binary_opcode of the reply due */
+    int reply_status;       /* binary: its errno, 0 = done */
+    char *reply_body;       /* binary: reply payload other than a replay */
+    size_t reply_len;
+    off_t subscribe_from;   /* where the last replay stopped, -1 = unknown */
+};
+
+/* An in-progress replay; holds the snapshot the client will receive */
+struct store_replay {
+    off_t start;            /* where the replay began, pos - start = bytes so far */
+    off_t pos;
+    off_t end;              /* snapshot length, -1 = read until EOF */
+    int locked;             /* holds the read side of the store lock */
+    int pipe_fd[2];         /* splice staging pipe, created on demand */
+    size_t piped;           /* bytes waiting in the pipe */
+    int compressed;         /* copy through aesd-deflate.c until the end */
+    struct replay_deflate *deflate;
+    char *body;             /* binary reply sent instead of the store */
+};
+
+/*
+ * Storage backend (aesd-store-*.c). The front end serializes appends,
+ * takes the store lock for device replays, clamps reads to the replay
+ * snapshot and advances replay->pos; optional hooks may be NULL.
+ */
+struct store_backend {
+    const char *name;
+    const char *path;       /* NULL when no file is involved */
+    int device;             /* driver owns the data: locked replays, no timestamps */
+
+    int (*init)(void);
+    void (*cleanup)(void);
+    int (*open)(struct store_handle *handle);                   /* optional */
+    void (*close)(struct store_handle *handle);                 /* optional */
+
+    /* Called with the store lock held for writing */
+    int (*appendv)(const struct iovec *iov, int iovcnt);
+    /* Optional: make every append so far durable; called without the lock */
+    int (*sync)(void);
+    /* Optional: 0 or -1 with errno; without it seeks go through the packet index */
+    int (*seekto)(struct store_handle *handle, unsigned int write_cmd,
+                  unsigned int write_cmd_offset);
+    off_t (*size)(void);
+
+    void (*replay_begin)(struct store_handle *handle, struct store_replay *replay); /* optional */
+    ssize_t (*replay_read)(struct store_handle *handle, struct store_replay *replay,
+                           char *buf, size_t size);
+    /* Zero-copy: sendfile from handle->fd at file_offset(pos), or a custom hook */
+    off_t (*file_offset)(off_t pos);                            /* optional */
+    ssize_t (*replay_send)(struct store_handle *handle, struct store_replay *replay,
+                           int sock_fd, size_t size);           /* optional */
+
+    /*
+     * Hot restart, both optional: export hands over an fd holding the data
+     * (-1 when the successor's init finds it anyway) and stops cleanup from
+     * discarding it; import adopts that fd instead of init
+     */
+    int (*handoff_export)(int *fd, off_t *size);
+    int (*handoff_import)(int fd, off_t size);
+};
+
+extern const struct store_backend store_backend_chardev;
+extern const struct store_backend store_backend_file;
+extern const struct store_backend store_backend_mmap;
+extern const struct store_backend store_backend_memory;
+
+/* NULL for an unknown name */
+const struct store_backend *store_backend_find(const char *name);
+
+int store_init(const char *backend_name);
+void store_cleanup(void);
+
+/* Hot restart: the running backend's state, then the successor's init from it */
+int store_handoff_export(const char **backend_name, int *fd, off_t *size);
+int store_init_handoff(const char *backend_name, int fd, off_t size);
+int store_is_device(void);
+int store_open(struct store_handle *handle);
+void store_close(struct store_handle *handle);
+
+/* Bytes held by the store */
+off_t store_size(void);
+
+/* writev() the whole vector, resuming after short writes */
+int store_writev_all(int fd, const struct iovec *iov, int iovcnt);
+
+/* Append complete packets; only concurrent appends are serialized */
+int store_append(const char *buf, size_t len);
+int store_appendv(const struct iovec *iov, int iovcnt);
+int store_seekto(struct store_handle *handle, unsigned int write_cmd,
+                 unsigned int write_cmd_offset);
+
+/*
+ * Replay the store from the start, or from the AESDCHAR_IOCSEEKTO
+ * position. Every begin must be paired with store_replay_end(). While
+ * replay->locked is set appends are blocked, so callers that cannot
+ * finish promptly should drain the replay into memory first.
+ */
+void store_replay_begin(struct store_handle *handle, struct store_replay *replay);
+
+/*
+ * Delta replays, requested with AESDREPLAY packets: start at a byte
+ * offset, at write command write_cmd, or at the store size the client
+ * saw when it connected. Offsets past the end give an empty replay.
+ * store_replay_all() drops any earlier seek: the next replay is complete.
+ */
+int store_replay_from(struct store_handle *handle, off_t offset);
+int store_replay_since(struct store_handle *handle, unsigned int write_cmd);
+void store_replay_new(struct store_handle *handle);
+void store_replay_all(struct store_handle *handle);
+
+/* AESDREPLAY:deflate: this client's replays are sent gzip compressed */
+void store_replay_deflate(struct store_handle *handle);
+
+/* AESDREPLAY:subscribe: after the replay, hand the client to pubsub_subscribe() */
+void store_replay_subscribe(struct store_handle *handle);
+
+/*
+ * AESDREPLAY:keepalive: every packet from this one on gets its own
+ * reply, REPLY_HEADER and then the replay, and the connection stays
+ * open. Not with compressed replays, whose length is not known up front:
+ * those replies are unframed and the connection closes after them.
+ */
+void store_replay_keepalive(struct store_handle *handle);
+
+/* Replay bytes still to come; -1 when only reading them will tell */
+off_t store_replay_remaining(const struct store_replay *replay);
+
+/*
+ * The reply to a binary record: op with errno status, and body (malloc'ed,
+ * may be NULL) as its payload. The next replay sends that payload instead
+ * of the store, unless op is BINARY_OP_REPLAY or BINARY_OP_SEEKTO.
+ */
+void store_reply_binary(struct store_handle *handle, int op, int status,
+                        char *body, size_t len);
+
+/* Write the reply header for len bytes, text or binary; returns its length */
+size_t store_reply_header(const struct store_handle *handle, char *buf, size_t size,
+                          off_t len);
+
+ssize_t store_replay_read(struct store_handle *handle, struct store_replay *replay,
+                          char *buf, size_t size);
+
+/*
+ * Zero-copy replay step: move the next chunk to sock_fd without passing
+ * it through user space. Returns the bytes sent, 0 at the end of the
+ * replay or -1 with errno set. EOPNOTSUPP means the backend cannot do
+ * it; continue the same replay with store_replay_read() instead.
+ */
+ssize_t store_replay_send(struct store_handle *handle, struct store_replay *replay,
+                          int sock_fd);
+
+/*
+ * Where the next chunk of the replay lives, for callers that do their
+ * own I/O (io_uring): sets *fd and *offset, advances the replay and
+ * returns the chunk length, at most max, or 0 at the end. -1 with
+ * EOPNOTSUPP when the backend has no stable file offsets; use
+ * store_replay_read() then.
+ */
+ssize_t store_replay_extent(struct store_handle *handle, struct store_replay *replay,
+                            size_t max, int *fd, off_t *offset);
+void store_replay_end(struct store_replay *replay);
+
+/* -------------------------------------------------------------------------
+ * Compressed replays (aesd-deflate.c)
+ * ----------------------------------------------------------------------*/
+
+/* Uncompressed replay step, as store_replay_read() without compression */
+typedef ssize_t (*store_read_fn)(struct store_handle *handle, struct store_replay *replay,
+                                 char *buf, size_t size);
+
+/*
+ * Next bytes of the gzip stream for a compressed replay, taking store
+ * bytes from raw_read. Whole blocks of a cacheable store (stable
+ * offsets) are compressed once and shared by every replay.
+ */
+ssize_t deflate_replay_read(struct store_handle *handle, struct store_replay *replay,
+                            char *buf, size_t size, int cacheable, store_read_fn raw_read);
+void deflate_replay_end(struct store_replay *replay);
+void deflate_cache_cleanup(void);
+
+/* Hot restart: stream the block cache to the successor, which keeps the blocks its store covers */
+int deflate_cache_export(int fd);
+int deflate_cache_import(int fd, off_t store_size);
+
+/* -------------------------------------------------------------------------
+ * Packet offset index (aesd-index.c)
+ * ----------------------------------------------------------------------*/
+
+int packet_index_init(void);
+void packet_index_cleanup(void);
+
+/* Record packets appended at offset start, one per iovec; store write lock held */
+void packet_index_append(off_t start, const struct iovec *iov, int iovcnt);
+
+/* Index the first size bytes already in the store */
+int packet_index_rebuild(struct store_handle *handle, store_read_fn raw_read, off_t size);
+
+size_t packet_index_count(void);
+
+/* Set once the reserve ran out: later packets are not indexed */
+int packet_index_full(void);
+
+/* Start of write command write_cmd, clamped to the end of the indexed packets */
+off_t packet_index_start(size_t write_cmd);
+
+/* Start and length of an indexed write command; -1 with ENOENT past the index */
+int packet_index_lookup(size_t write_cmd, off_t *start, off_t *len);
+
+/* -------------------------------------------------------------------------
+ * Memory-mapped packet log (aesd-mmap-log.c)
+ * ----------------------------------------------------------------------*/
+
+struct mmap_log {
+    int fd;
+    char *base;             /* reserved address range, header first */
+    size_t mapped;          /* bytes of the file mapped at base */
+    atomic_size_t committed;
+};
+
+/* Open or create the log, recovering the committed length of a previous run */
+int mmap_log_open(struct mmap_log *log, const char *path);
+void mmap_log_close(struct mmap_log *log);
+
+/* Caller serializes appends; readers only need mmap_log_committed() */
+int mmap_log_appendv(struct mmap_log *log, const struct iovec *iov, int iovcnt);
+size_t mmap_log_committed(struct mmap_log *log);
+const char *mmap_log_data(struct mmap_log *log);
+
+/* File offset of the first packet byte, for sendfile and friends */
+off_t mmap_log_data_offset(void);
+
+/* -------------------------------------------------------------------------
+ * Connection memory (aesd-slab.c)
+ * ----------------------------------------------------------------------*/
+
+/* Fixed-size objects owned by one thread; no locking */
+struct obj_slab {
+    size_t obj_size;
+    unsigned per_chunk;
+    void *free_list;
+    struct slab_chunk *chunks;
+};
+
+void slab_init(struct obj_slab *slab, size_t obj_size, unsigned per_chunk);
+/* Zeroed object, NULL when out of memory */
+void *slab_alloc(struct obj_slab *slab);
+void slab_free(struct obj_slab *slab, void *obj);
+void slab_destroy(struct obj_slab *slab);
+
+/* Recycled receive buffers, shared by all threads */
+char *rxbuf_get(size_t *cap);
+void rxbuf_put(char *buf, size_t cap);
+void rxbuf_cache_drain(void);
+
+/* -------------------------------------------------------------------------
+ * Admission control (aesd-admission.c)
+ * ----------------------------------------------------------------------*/
+
+void admission_init(void);
+void admission_cleanup(void);
+
+/*
+ * Called right after accept. Returns -1 when client_ip already holds
+ * max_conns_per_ip connections: close the socket. Otherwise *slot is
+ * the client's slot (NULL without limits) until admission_release().
+ */
+int admission_acquire(const char *client_ip, struct admission_slot **slot);
+void admission_release(struct admission_slot *slot);
+
+/* Take a batch from the token buckets; -1 means drop the connection */
+int admission_charge(struct admission_slot *slot, unsigned packets, size_t bytes);
+
+/* -------------------------------------------------------------------------
+ * Packet framer (aesd-framer.c)
+ * ----------------------------------------------------------------------*/
+
+/* Bytes received on one connection that do not form a packet yet */
+struct packet_framer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t scanned;         /* prefix of buf known to hold no newline */
+    struct admission_slot *admission;   /* rate limits, set by the engine */
+    int negotiated;         /* text or binary decided by the first bytes */
+    int reply_due;          /* binary: a record that needs a reply was handled */
+    int quiet_errno;        /* binary: failed quiet APPEND, for the next reply */
+    int rate_limited;       /* an append was refused by admission_charge() */
+};
+
+void framer_init(struct packet_framer *framer);
+void framer_free(struct packet_framer *framer);
+
+/*
+ * Room for the next recv (at least BUFFER_SIZE), NULL when out of memory.
+ * The buffer comes from the receive buffer cache and goes back to it
+ * in framer_free().
+ */
+char *framer_reserve(struct packet_framer *framer, size_t *room);
+void framer_commit(struct packet_framer *framer, size_t len);
+
+/*
+ * Apply every complete packet to the store: AESDCHAR_IOCSEEKTO commands
+ * through store_seekto(), data packets through batched appends.
+ * Returns the number of packets handled, -1 if an append failed or the
+ * pending packet is longer than server_config.max_packet_size.
+ * framer->len == 0 afterwards means no partial packet is pending.
+ * A connection that starts with BINARY_PREAMBLE is parsed as binary
+ * records instead; failed requests there get an error reply.
+ */
+int framer_process(struct packet_framer *framer, struct store_handle *handle);
+
+/*
+ * Whether framer_process() returning packets completed a request: no
+ * partial packet is pending, or the connection is keep-alive and a
+ * packet was handled, or a binary record that needs a reply was.
+ */
+int framer_request_done(const struct packet_framer *framer, const struct store_handle *handle,
+                        int packets);
+
+/*
+ * After a keep-alive reply: handle the next pipelined packet, if one is
+ * buffered. 1 when that completed a request, 0 when more data is
+ * needed, -1 as framer_process().
+ */
+int framer_next_request(struct packet_framer *framer, struct store_handle *handle);
+
+/* -------------------------------------------------------------------------
+ * Listener shards (aesd-shard.c)
+ * ----------------------------------------------------------------------*/
+
+/*
+ * One shard per event loop. Shards share server_socket_fd unless
+ * server_config.reuseport is set; then shard 0 keeps it and the others
+ * open their own SO_REUSEPORT listeners.
+ */
+int shards_init(int count);
+void shards_cleanup(void);
+int shard_listen_fd(int shard);
+
+/* Pin the calling loop thread to its shard's CPU (reuseport only) */
+void shard_pin_thread(int shard);
+void shard_count_accept(int shard);
+void shards_log_stats(void);
+
+/* -------------------------------------------------------------------------
+ * Metrics (aesd-metrics.c)
+ * ----------------------------------------------------------------------*/
+
+/* Recording is per-thread and lock-free, cheap enough for every request */
+uint64_t metrics_now_ns(void);
+void metrics_conn_accepted(void);
+void metrics_conn_closed(uint64_t request_ns);
+void metrics_request_done(uint64_t request_ns);
+void metrics_idle_closed(void);
+void metrics_bytes_in(size_t len);
+void metrics_replay_done(size_t len);
+void metrics_packets_appended(unsigned count);
+void metrics_lock_wait(uint64_t ns);
+void metrics_slow_client_evicted(void);
+void metrics_conn_rejected(void);
+void metrics_rate_limited(void);
+void metrics_deflate_block(size_t raw_len, size_t compressed_len, int cached);
+void metrics_replication_bytes(size_t len);
+void metrics_bytes_pushed(size_t len);
+void metrics_subscriber_dropped(void);
+void metrics_subscriber_skipped(uint64_t bytes);
+void metrics_store_synced(uint64_t ns);
+
+/* Text snapshot, one "name value" per line; returns the length */
+#define METRICS_REPORT_SIZE 4096
+size_t metrics_format(char *buf, size_t size);
+
+/* Serve snapshots on an AF_UNIX socket from a background thread */
+int metrics_server_start(const char *path);
+void metrics_server_stop(void);
+
+/* -------------------------------------------------------------------------
+ * Timestamps (aesd-timer.c)
+ * ----------------------------------------------------------------------*/
+
+/* Append a timestamp packet every TIMESTAMP_INTERVAL_S from a thread */
+int timestamp_timer_start(void);
+void timestamp_timer_stop(void);
+
+/* -------------------------------------------------------------------------
+ * Hot restart (aesd-handoff.c)
+ * ----------------------------------------------------------------------*/
+
+/*
+ * Successor side, before daemonizing: take the listeners of the instance
+ * serving server_config.handoff_path. 1 when they were adopted, 0 when
+ * nobody is serving it (a cold start), -1 on error.
+ */
+int handoff_takeover(void);
+
+/* store_init(), or the predecessor's store once it has drained */
+int handoff_store_init(void);
+
+/* Serve server_config.handoff_path for the next upgrade */
+int handoff_server_start(void);
+
+/* First thing at shutdown: no handoff can begin after this returns */
+void handoff_server_stop(void);
+
+/* Listeners are handed off: drain connections, at most HANDOFF_DRAIN_MS */
+int handoff_draining(void);
+
+/* Called between stopping the engines and store_cleanup() */
+void handoff_finish(void);
+
+/* Whole-buffer I/O on the handoff connection; 0 or -1 */
+int handoff_write_all(int fd, const void *buf, size_t len);
+int handoff_read_all(int fd, void *buf, size_t len);
+
+/* -------------------------------------------------------------------------
+ * Replication (aesd-replica.c)
+ * ----------------------------------------------------------------------*/
+
+/* Primary: stream the store to replicas on server_config.replication_port */
+int replication_server_start(void);
+
+/* Replica: follow server_config.replica_of into the local store */
+int replica_start(void);
+
+/* Either side; before store_cleanup() */
+void replication_stop(void);
+
+/* An append was committed: wake the replica sessions. Cheap without any */
+void replication_notify(void);
+
+/* Lag lines for metrics_format(); returns the length, 0 when not replicating */
+size_t replication_metrics_format(char *buf, size_t size);
+
+/* -------------------------------------------------------------------------
+ * Subscriptions (aesd-pubsub.c)
+ * ----------------------------------------------------------------------*/
+
+/* Ring and push thread, once the store is up; nothing with --subscribe-ring 0 */
+int pubsub_start(void);
+
+/* After the engines stopped, before store_cleanup() */
+void pubsub_stop(void);
+
+/* Called with the store write lock held, after the packets are committed */
+void pubsub_publish(const struct iovec *iov, int iovcnt);
+
+/*
+ * Take over a client whose AESDREPLAY:subscribe replay was sent: a
+ * duplicate of client_fd is kept, the engine closes its own as usual.
+ * Pushing starts at handle->subscribe_from. -1 when it cannot subscribe.
+ */
+int pubsub_subscribe(int client_fd, const char *client_ip, const struct store_handle *handle);
+
+/* "subscribers" line for metrics_format(); returns the length */
+size_t pubsub_metrics_format(char *buf, size_t size);
+
+/* -------------------------------------------------------------------------
+ * Epoll engine (aesd-epoll.c)
+ * ----------------------------------------------------------------------*/
+
+/*
+ * Serve clients from server_config.num_loops epoll loops until
+ * exit_signal_flag is raised. Expects server_socket_fd to be listening.
+ * Returns 0 on a clean shutdown, -1 if the loops could not be started.
+ */
+int epoll_server_run(void);
+
+/* -------------------------------------------------------------------------
+ * Worker pool engine (aesd-pool.c)
+ * ----------------------------------------------------------------------*/
+
+/*
+ * Accept on the calling thread and hand connections to
+ * server_config.num_workers workers until exit_signal_flag is raised.
+ * SIGUSR1 logs the pool saturation counters.
+ * Returns 0 on a clean shutdown, -1 if the pool could not be started.
+ */
+int pool_server_run(void);
+
+/* -------------------------------------------------------------------------
+ * io_uring engine (aesd-uring.c)
+ * ----------------------------------------------------------------------*/
+
+/*
+ * Serve clients from server_config.num_loops io_uring loops until
+ * exit_signal_flag is raised. Probes the kernel first and runs
+ * epoll_server_run() instead when io_uring cannot be used.
+ */
+int uring_server_run(void);
+
+#endif /* AESDSOCKET_H */